@@ -1,69 +1,374 @@
 #include "Animation.h"
-#include <QDomDocument>
 #include "Utils.h"
 #include <QDebug>
 #include "LxStream.h"
+#include "LxBatchWriter.h"
 #include <QtMath>
 #include <QQuaternion>
+#include <QVector>
+#include <QHash>
+#include "OgreBinary.h"
+#include "Gltf.h"
+#include "ParallelXml.h"
+#include "XmlScanner.h"
+#include "AssetCache.h"
+#include <QXmlStreamReader>
+#include <QFile>
+#include <QtConcurrent>
+#include <algorithm>
+
+// Translation, rotation, scale and a second rotation per frame
+const int FLOATS_PER_FRAME = 14;
 
 Animation::Animation() {
+    fps = 30;
+    length = 0;
+}
+
+// Reads the keyframes of a <keyframes> element the way the DOM walk in
+// fromFile() does. Works with both QXmlStreamReader and XmlScanner.
+template <typename Reader>
+static void readKeyframes(Reader &xml, QList<Keyframe> &keyframes) {
+    while(xml.readNextStartElement()) {
+        Keyframe kf;
+        kf.time = xml.attributes().value("time").toFloat();
+
+        QVector3D translation, axis;
+        float angle = 0;
+        bool gotTranslate = false, gotRotate = false;
+        while(xml.readNextStartElement()) {
+            auto attributes = xml.attributes();
+            if(!gotTranslate && xml.name() == QLatin1String("translate")) {
+                translation = QVector3D(attributes.value("x").toFloat(),
+                                        attributes.value("y").toFloat(),
+                                        attributes.value("z").toFloat());
+                gotTranslate = true;
+            } else if(!gotRotate && xml.name() == QLatin1String("rotate")) {
+                angle = attributes.value("angle").toFloat();
+                gotRotate = true;
+
+                bool gotAxis = false;
+                while(xml.readNextStartElement()) {
+                    if(!gotAxis && xml.name() == QLatin1String("axis")) {
+                        auto axisAttributes = xml.attributes();
+                        axis = QVector3D(axisAttributes.value("x").toFloat(),
+                                         axisAttributes.value("y").toFloat(),
+                                         axisAttributes.value("z").toFloat());
+                        gotAxis = true;
+                    }
+                    xml.skipCurrentElement();
+                }
+                continue;
+            }
+            xml.skipCurrentElement();
+        }
+
+        kf.translation = translation;
+        kf.rotation = QQuaternion::fromAxisAndAngle(axis, qRadiansToDegrees(angle));
+        keyframes.append(kf);
+    }
+}
+
+struct KeyframePiece {
+    QByteArray data;
+    QList<Keyframe> keyframes;
+    bool ok;
+};
+
+// Scanned from the raw bytes first, anything the scanner doesn't handle is
+// parsed again with QXmlStreamReader.
+static void parseKeyframePiece(KeyframePiece &piece) {
+    XmlScanner scanner(piece.data.constData(), piece.data.length());
+    readKeyframes(scanner, piece.keyframes);
+    piece.ok = !scanner.hasError();
+    if(piece.ok) {
+        return;
+    }
 
+    piece.keyframes.clear();
+    QXmlStreamReader xml;
+    piece.ok = ParallelXml::openPiece(xml, piece.data);
+    readKeyframes(xml, piece.keyframes);
+    piece.ok = piece.ok && !xml.hasError();
 }
 
-Animation Animation::fromFile(QString filepath) {
+// Parses a cut out <keyframes> section on the thread pool.
+static bool readKeyframesParallel(const QByteArray &section, QList<Keyframe> &keyframes) {
+    QVector<KeyframePiece> pieces;
+    for(const QByteArray &data : ParallelXml::split(section, "keyframe")) {
+        pieces.append({data, QList<Keyframe>(), false});
+    }
+    QtConcurrent::blockingMap(pieces, parseKeyframePiece);
+
+    for(const KeyframePiece &piece : pieces) {
+        if(!piece.ok) {
+            return false;
+        }
+        keyframes.append(piece.keyframes);
+    }
+    return true;
+}
+
+// Loads the parsed animation from its cache if that is up to date, otherwise
+// parses the file and caches the result. Without a name the file's first
+// animation is loaded.
+Animation Animation::fromFile(QString filepath, bool parallel, const QString &animationName) {
+    QString kind = "animation";
+    if(!animationName.isEmpty()) {
+        kind += "-" + QString::number(qHash(animationName), 16);
+    }
+    AssetCache cache(filepath, kind);
+    LxStream stream;
     Animation animation;
-    animation.fps = 30;
-
-    QDomDocument doc = Utils::readXMLFile(filepath);
-    QDomElement an = doc.firstChildElement("skeleton")
-            .firstChildElement("animations")
-            .firstChildElement("animation");
-    animation.length = an.attribute("length").toFloat();
-    QDomNodeList trackList = an.firstChildElement("tracks").childNodes();
-    for(int i = 0; i < trackList.length(); i++) {
-        QDomElement trackElement = trackList.item(i).toElement();
-        Track track;
+    if(cache.load(stream)) {
+        animation.readCache(stream);
+        return animation;
+    }
 
-        track.bone = trackElement.attribute("bone");
+    QList<Animation> animations;
+    Skeleton skeleton = parseFile(filepath, parallel, animationName, false, animations);
+    if(animations.isEmpty()) {
+        // Not cached, so that the error is reported again next time
+        animation.skeleton = skeleton;
+        return animation;
+    }
+    animation = animations.first();
+    animation.skeleton = skeleton;
+
+    QByteArray payload;
+    LxStream out(&payload);
+    out.setBuffered();
+    animation.writeCache(out);
+    out.close();
+    cache.store(payload);
+
+    return animation;
+}
 
-        if(track.bone != "root") {
-            track.bone = "Dx_" + track.bone;
+// Parses a skeleton file once and returns every animation in it. They all
+// share the file's skeleton.
+QList<Animation> Animation::allFromFile(QString filepath, bool parallel) {
+    AssetCache cache(filepath, "animations");
+    LxStream stream;
+    QList<Animation> animations;
+    if(cache.load(stream)) {
+        Skeleton skeleton;
+        skeleton.readCache(stream);
+        int count = stream.readInt();
+        for(int i = 0; i < count; i++) {
+            Animation animation;
+            animation.readClip(stream);
+            animation.skeleton = skeleton;
+            animations.append(animation);
         }
+        return animations;
+    }
 
-        QDomNodeList keyframes = trackElement.firstChildElement("keyframes").childNodes();
-        for(int j = 0; j < keyframes.length(); j++) {
-            QDomElement keyframe = keyframes.item(j).toElement();
-            Keyframe kf;
-            kf.time = keyframe.attribute("time").toFloat();
+    Skeleton skeleton = parseFile(filepath, parallel, QString(), true, animations);
+    if(animations.isEmpty()) {
+        return animations;
+    }
 
-            QDomElement tr = keyframe.firstChildElement("translate");
-            kf.translation = {
-                tr.attribute("x").toFloat(),
-                tr.attribute("y").toFloat(),
-                tr.attribute("z").toFloat(),
-            };
+    QByteArray payload;
+    LxStream out(&payload);
+    out.setBuffered();
+    skeleton.writeCache(out);
+    out.writeInt(animations.length());
+    for(const Animation &animation : animations) {
+        animation.writeClip(out);
+    }
+    out.close();
+    cache.store(payload);
 
-            QDomElement rt = keyframe.firstChildElement("rotate");
-            float angle = rt.attribute("angle").toFloat();
+    return animations;
+}
 
-            QDomElement ax = rt.firstChildElement("axis");
-            QVector3D vec = {
-                ax.attribute("x").toFloat(),
-                ax.attribute("y").toFloat(),
-                ax.attribute("z").toFloat(),
-            };
+struct ExportJob {
+    Animation animation;
+    const AnimationExport *clip;
+    const Skeleton *bindPose;
+    LxBatchWriter *batch;
+};
+
+static void exportJob(ExportJob &job) {
+    job.animation.applyBindPose(*job.bindPose);
+    job.animation.setExtraData(job.clip->extraData);
+    job.animation.exportAnm(job.clip->filepath, job.batch);
+}
 
-            kf.rotation = QQuaternion::fromAxisAndAngle(vec, qRadiansToDegrees(angle));
+// Exports the requested animations on the thread pool, each with its own
+// output file and ExtraData.
+void Animation::exportAll(const QList<Animation> &animations, const Skeleton &bindPose,
+                          const QList<AnimationExport> &exports, LxBatchWriter *batch) {
+    QHash<QString, int> byName;
+    for(int i = animations.length() - 1; i >= 0; i--) {
+        byName.insert(animations[i].name(), i);
+    }
 
-            track.keyframes.append(kf);
+    QVector<ExportJob> jobs;
+    for(const AnimationExport &clip : exports) {
+        if(!byName.contains(clip.animation)) {
+            qDebug() << "Animation" << clip.animation << "not found";
+            continue;
         }
+        jobs.append({animations[byName.value(clip.animation)], &clip, &bindPose, batch});
+    }
+    QtConcurrent::blockingMap(jobs, exportJob);
+}
 
-        animation.tracks.append(track);
+// Streams only the bones, the hierarchy and the requested animations and
+// stops as soon as it has them: the named one, the first one, or with all
+// set every one. In parallel mode long keyframe lists are parsed on worker
+// threads; the result is the same as the serial one.
+Skeleton Animation::parseFile(QString filepath, bool parallel, const QString &animationName, bool all,
+                              QList<Animation> &animations) {
+    if(filepath.endsWith(".skeleton", Qt::CaseInsensitive)) {
+        return parseBinaryFile(filepath, animationName, all, animations);
+    }
+    if(filepath.endsWith(".glb", Qt::CaseInsensitive)) {
+        return parseGltfFile(filepath, animationName, all, animations);
     }
 
-    animation.skeleton = Skeleton::fromDocument(doc);
+    ParallelXml::Document cuts;
+    bool cut = parallel && ParallelXml::load(filepath, {"keyframes"}, cuts);
+
+    QFile file(filepath);
+    QByteArray data;
+    if(cut) {
+        data = cuts.remainder;
+    } else if(file.open(QIODevice::ReadOnly)) {
+        data = Utils::mapFile(file);
+    } else {
+        qDebug() << "Couldn't open file.";
+        return Skeleton();
+    }
 
-    return animation;
+    // Scanned from the raw bytes first, anything the scanner doesn't handle
+    // is parsed again with QXmlStreamReader
+    SkeletonSections sections;
+    XmlScanner scanner(data.constData(), data.length());
+    bool ok = readDocument(scanner, cut ? &cuts : 0, animationName, all, sections, animations);
+    bool broken = false;
+    QString error;
+    if(scanner.hasError()) {
+        sections = SkeletonSections();
+        animations.clear();
+        QXmlStreamReader xml(data);
+        ok = readDocument(xml, cut ? &cuts : 0, animationName, all, sections, animations);
+        broken = xml.hasError();
+        error = xml.errorString();
+    }
+
+    if(!ok || (cut && broken)) {
+        animations.clear();
+        return parseFile(filepath, false, animationName, all, animations);
+    }
+    if(broken) {
+        qDebug() << "Couldn't parse" << filepath << ":" << error;
+        animations.clear();
+        return Skeleton();
+    }
+    if(animations.isEmpty() && !animationName.isEmpty()) {
+        qDebug() << "Animation" << animationName << "not found in" << filepath;
+    }
+
+    Skeleton skeleton = Skeleton::fromSections(sections);
+    for(Animation &animation : animations) {
+        animation.skeleton = skeleton;
+    }
+    return skeleton;
+}
+
+// Reads the sections parseFile() asks for. Returns false if a section cut out
+// of cuts couldn't be parsed.
+template <typename Reader>
+bool Animation::readDocument(Reader &xml, const ParallelXml::Document *cuts, const QString &animationName,
+                             bool all, SkeletonSections &sections, QList<Animation> &animations) {
+    bool gotAnimations = false, found = false, ok = true;
+    if(xml.readNextStartElement() && xml.name() == QLatin1String("skeleton")) {
+        while(ok && !(sections.done() && gotAnimations) && xml.readNextStartElement()) {
+            if(Skeleton::readSection(xml, sections)) {
+                continue;
+            }
+            if(gotAnimations || xml.name() != QLatin1String("animations")) {
+                xml.skipCurrentElement();
+                continue;
+            }
+            gotAnimations = true;
+
+            while(ok && !found && xml.readNextStartElement()) {
+                QString name = xml.attributes().value("name").toString();
+                if(xml.name() != QLatin1String("animation")
+                        || (!animationName.isEmpty() && name != animationName)) {
+                    xml.skipCurrentElement();
+                    continue;
+                }
+                found = !all;
+
+                Animation animation;
+                animation.animationName = name;
+                ok = animation.readAnimation(xml, cuts);
+                animations.append(animation);
+            }
+
+            // Only finish <animations> if the skeleton still comes after it
+            if(found && !sections.done()) {
+                xml.skipCurrentElement();
+            }
+        }
+    }
+    return ok;
+}
+
+// Reads the current <animation> element with the same rules as the old DOM
+// walk: the first <tracks>, and the first <keyframes> of every track. Returns
+// false if a section cut out of cuts couldn't be parsed.
+template <typename Reader>
+bool Animation::readAnimation(Reader &xml, const ParallelXml::Document *cuts) {
+    length = xml.attributes().value("length").toFloat();
+
+    bool gotTracks = false;
+    while(xml.readNextStartElement()) {
+        if(gotTracks || xml.name() != QLatin1String("tracks")) {
+            xml.skipCurrentElement();
+            continue;
+        }
+        gotTracks = true;
+
+        while(xml.readNextStartElement()) {
+            Track track;
+
+            track.bone = xml.attributes().value("bone").toString();
+
+            if(track.bone != "root") {
+                track.bone = "Dx_" + track.bone;
+            }
+
+            bool gotKeyframes = false;
+            while(xml.readNextStartElement()) {
+                if(gotKeyframes || xml.name() != QLatin1String("keyframes")) {
+                    xml.skipCurrentElement();
+                    continue;
+                }
+                gotKeyframes = true;
+
+                auto attributes = xml.attributes();
+                if(!cuts || !attributes.hasAttribute(ParallelXml::CUT_ATTRIBUTE)) {
+                    readKeyframes(xml, track.keyframes);
+                    continue;
+                }
+
+                int section = attributes.value(ParallelXml::CUT_ATTRIBUTE).toInt();
+                if(!readKeyframesParallel(cuts->section(section), track.keyframes)) {
+                    return false;
+                }
+                xml.skipCurrentElement();
+            }
+
+            tracks.append(track);
+        }
+    }
+    return true;
 }
 
 Animation Animation::dummy() {
@@ -100,80 +405,88 @@ Animation Animation::dummy() {
     return animation;
 }
 
-void Animation::exportAnm(QString filepath) {
-    LxStream stream(filepath, LxStream::WriteOnly);
+// If a batch is given, the file is only written once the batch is flushed.
+void Animation::exportAnm(QString filepath, LxBatchWriter *batch) {
+    // Rough size of the file, so the memory stream doesn't need to grow
+    long long sizeHint = 1024 + (tracks.length() + 1) * (64 + int(fps * length) * FLOATS_PER_FRAME * 4);
+
+    LxStream stream;
+    if(batch) {
+        batch->open(stream, filepath, sizeHint);
+    } else {
+        stream.openAtomicFile(filepath, sizeHint);
+    }
     writeHeader(stream);
 
+    int numFrames = fps * length;
+    QVector<float> frames(numFrames * FLOATS_PER_FRAME);
+
     for(Track track : tracks) {
         if(track.bone == "root") {
             Utils::writeString(stream, "Target_CTRL");
         } else {
             Utils::writeString(stream, track.bone);
         }
-        int numFrames = fps * length;
+
+        QQuaternion boneRotation = skeleton.bone(track.bone).rotation.inverted();
+        float *f = frames.data();
 
         for(int i = 0; i < numFrames; i++) {
             float time = float(i) / float(fps);
             Keyframe kf = track.getKeyframeAt(time);
 
-            QVector3D convertedTrans = skeleton.bone(track.bone).rotation.inverted() * kf.translation;
+            QVector3D convertedTrans = boneRotation * kf.translation;
             QQuaternion rotation = kf.rotation.inverted();
 
             // Translation
-            stream.writeFloat(convertedTrans.x());
-            stream.writeFloat(convertedTrans.y());
-            stream.writeFloat(convertedTrans.z());
+            *f++ = convertedTrans.x();
+            *f++ = convertedTrans.y();
+            *f++ = convertedTrans.z();
 
             // Rotation
-            stream.writeFloat(rotation.x());
-            stream.writeFloat(rotation.y());
-            stream.writeFloat(rotation.z());
-            stream.writeFloat(rotation.scalar());
+            *f++ = rotation.x();
+            *f++ = rotation.y();
+            *f++ = rotation.z();
+            *f++ = rotation.scalar();
 
             // Scale
-            stream.writeFloat(1);
-            stream.writeFloat(1);
-            stream.writeFloat(1);
+            *f++ = 1;
+            *f++ = 1;
+            *f++ = 1;
 
             // Another Rotation >.>
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(1);
+            *f++ = 0;
+            *f++ = 0;
+            *f++ = 0;
+            *f++ = 1;
         }
+
+        stream.writeArray(frames.constData(), frames.size());
     }
 
     {
         Utils::writeString(stream, "Bip01");
-        int numFrames = fps * length;
 
-        for(int i = 0; i < numFrames; i++) {
-            // Translation
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(0);
+        const float frame[FLOATS_PER_FRAME] = {
+            0, 0, 0,    // Translation
+            0, 0, 0, 1, // Rotation
+            0, 0, 0,    // Scale
+            0, 0, 0, 1  // Another Rotation >.>
+        };
 
-            // Rotation
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(1);
-
-            // Scale
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-
-            // Another Rotation >.>
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(0);
-            stream.writeFloat(1);
+        float *f = frames.data();
+        for(int i = 0; i < numFrames; i++) {
+            memcpy(f, frame, sizeof(frame));
+            f += FLOATS_PER_FRAME;
         }
+
+        stream.writeArray(frames.constData(), frames.size());
     }
 
     stream.writeQString(extraData.toString());
-    stream.close();
+    if(!stream.close()) {
+        qDebug() << "Couldn't write" << filepath;
+    }
 }
 
 void Animation::applyBindPose(Skeleton sk) {
@@ -289,3 +602,342 @@ QString ExtraData::toString() const {
 
     return str;
 }
+
+// Binary counterpart of parseFile(), in a single pass over the mapping.
+Skeleton Animation::parseBinaryFile(QString filepath, const QString &animationName, bool all,
+                                    QList<Animation> &animations) {
+    LxStream stream;
+    if(!OgreBinary::openFile(stream, filepath)) {
+        return Skeleton();
+    }
+
+    Skeleton skeleton = Skeleton::fromBinaryStream(stream);
+
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        if(chunk.id == OgreBinary::SKELETON_ANIMATION) {
+            QString name = OgreBinary::readString(stream);
+            if(animationName.isEmpty() || name == animationName) {
+                Animation animation;
+                animation.animationName = name;
+                animation.skeleton = skeleton;
+                animation.readBinaryAnimation(stream);
+                animations.append(animation);
+                if(!all) {
+                    break;
+                }
+            }
+        }
+        OgreBinary::skipChunk(stream, chunk);
+    }
+
+    if(animations.isEmpty() && !animationName.isEmpty()) {
+        qDebug() << "Animation" << animationName << "not found in" << filepath;
+    }
+    return skeleton;
+}
+
+// glTF counterpart of parseFile(). Unnamed animations are called after
+// their index.
+Skeleton Animation::parseGltfFile(QString filepath, const QString &animationName, bool all,
+                                  QList<Animation> &animations) {
+    Gltf::File file;
+    if(!Gltf::openFile(file, filepath)) {
+        return Skeleton();
+    }
+
+    Skeleton skeleton = Skeleton::fromGltf(file);
+
+    QJsonArray clips = file.json.value("animations").toArray();
+    for(int i = 0; i < clips.size(); i++) {
+        QString name = clips.at(i).toObject().value("name").toString();
+        if(name.isEmpty()) {
+            name = "animation" + QString::number(i);
+        }
+        if(!animationName.isEmpty() && name != animationName) {
+            continue;
+        }
+
+        Animation animation;
+        animation.animationName = name;
+        animation.skeleton = skeleton;
+        animation.readGltfAnimation(file, i);
+        animations.append(animation);
+        if(!all) {
+            break;
+        }
+    }
+
+    if(animations.isEmpty() && !animationName.isEmpty()) {
+        qDebug() << "Animation" << animationName << "not found in" << filepath;
+    }
+    return skeleton;
+}
+
+// The keys of one glTF sampler, one value of the given size per key
+struct GltfSampler {
+    GltfSampler() : components(0), step(false) {}
+
+    QVector<float> times;
+    QVector<float> values;
+    int components;
+    bool step;
+
+    // Index of the key at or before time and how far it is to the next one
+    int locate(float time, float &fraction) const {
+        fraction = 0;
+        int next = std::upper_bound(times.constBegin(), times.constEnd(), time) - times.constBegin();
+        if(next == 0) {
+            return 0;
+        }
+        if(next == times.size() || step) {
+            return next - 1;
+        }
+        fraction = (time - times[next - 1]) / (times[next] - times[next - 1]);
+        return next - 1;
+    }
+
+    const float *value(int key) const {
+        return values.constData() + key * components;
+    }
+};
+
+static bool readSampler(Gltf::File &file, const QJsonObject &sampler, int components, GltfSampler &out) {
+    int inputComponents = 0, outputComponents = 0;
+    if(!Gltf::readFloats(file, sampler.value("input").toInt(-1), out.times, inputComponents)
+            || !Gltf::readFloats(file, sampler.value("output").toInt(-1), out.values, outputComponents)
+            || inputComponents != 1 || outputComponents != components) {
+        return false;
+    }
+
+    QString interpolation = sampler.value("interpolation").toString("LINEAR");
+    int keys = out.times.size();
+    out.components = components;
+    out.step = interpolation == "STEP";
+
+    // Cubic splines store an in-tangent, the value and an out-tangent per
+    // key. Only the values are kept and interpolated linearly.
+    if(interpolation == "CUBICSPLINE" && out.values.size() == keys * components * 3) {
+        for(int i = 0; i < keys; i++) {
+            for(int c = 0; c < components; c++) {
+                out.values[i * components + c] = out.values[(i * 3 + 1) * components + c];
+            }
+        }
+        out.values.resize(keys * components);
+    }
+    return keys > 0 && out.values.size() == keys * components;
+}
+
+// glTF channels hold absolute local transforms, possibly with their own key
+// times for translation and rotation. Every track gets the union of both
+// plus the animation's end, and the keys are stored relative to the bone's
+// position in the skeleton like Ogre's are.
+void Animation::readGltfAnimation(Gltf::File &file, int index) {
+    QHash<int, QString> names = Gltf::jointNames(file, Gltf::findSkin(file));
+    for(auto it = names.begin(); it != names.end(); ++it) {
+        if(it.value() != "root") {
+            it.value() = "Dx_" + it.value();
+        }
+    }
+
+    QJsonObject clip = Gltf::object(file, "animations", index);
+    QJsonArray samplers = clip.value("samplers").toArray();
+
+    // Translation and rotation sampler of every animated joint
+    QMap<int, QPair<GltfSampler, GltfSampler> > channels;
+    for(const QJsonValue &value : clip.value("channels").toArray()) {
+        QJsonObject channel = value.toObject();
+        QJsonObject target = channel.value("target").toObject();
+        int node = target.value("node").toInt(-1);
+        QString path = target.value("path").toString();
+        if(!names.contains(node) || (path != "translation" && path != "rotation")) {
+            continue;
+        }
+
+        int sampler = channel.value("sampler").toInt(-1);
+        bool isRotation = path == "rotation";
+        GltfSampler &s = isRotation ? channels[node].second : channels[node].first;
+        if(sampler < 0 || sampler >= samplers.size()
+                || !readSampler(file, samplers.at(sampler).toObject(), isRotation ? 4 : 3, s)) {
+            qDebug() << "Invalid" << path << "channel for" << names.value(node);
+            s = GltfSampler();
+            continue;
+        }
+        length = qMax(length, s.times.last());
+    }
+
+    for(auto it = channels.constBegin(); it != channels.constEnd(); ++it) {
+        const GltfSampler &translation = it.value().first;
+        const GltfSampler &rotation = it.value().second;
+        if(translation.times.isEmpty() && rotation.times.isEmpty()) {
+            continue;
+        }
+
+        QVector<float> times = translation.times + rotation.times;
+        times.append(length);
+        std::sort(times.begin(), times.end());
+        times.erase(std::unique(times.begin(), times.end()), times.end());
+
+        Track track;
+        track.bone = names.value(it.key());
+        Bone bone = skeleton.bone(track.bone);
+        QQuaternion inverseRotation = bone.rotation.inverted();
+
+        track.keyframes.reserve(times.size());
+        for(float time : times) {
+            float fraction;
+            Keyframe kf;
+            kf.time = time;
+            kf.translation = QVector3D();
+            kf.rotation = QQuaternion();
+
+            if(!translation.times.isEmpty()) {
+                int key = translation.locate(time, fraction);
+                QVector3D a(translation.value(key)[0], translation.value(key)[1], translation.value(key)[2]);
+                if(fraction > 0) {
+                    QVector3D b(translation.value(key + 1)[0], translation.value(key + 1)[1], translation.value(key + 1)[2]);
+                    a += fraction * (b - a);
+                }
+                kf.translation = a - bone.position;
+            }
+
+            // Stored as x, y, z, w
+            if(!rotation.times.isEmpty()) {
+                int key = rotation.locate(time, fraction);
+                const float *v = rotation.value(key);
+                QQuaternion a(v[3], v[0], v[1], v[2]);
+                if(fraction > 0) {
+                    v = rotation.value(key + 1);
+                    a = QQuaternion::slerp(a, QQuaternion(v[3], v[0], v[1], v[2]), fraction);
+                }
+                kf.rotation = (inverseRotation * a).normalized();
+            }
+
+            track.keyframes.append(kf);
+        }
+
+        tracks.append(track);
+    }
+}
+
+// Smallest keyframe chunk: header, time, rotation and translation
+const int MIN_KEYFRAME_CHUNK_SIZE = OgreBinary::CHUNK_HEADER_SIZE + 8 * 4;
+
+void Animation::readBinaryAnimation(LxStream &stream) {
+    QHash<int, QString> boneNames;
+    for(const Bone &b : skeleton.bones) {
+        boneNames.insert(b.id, b.name);
+    }
+
+    length = stream.readFloat();
+
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        if(chunk.id == OgreBinary::SKELETON_ANIMATION_BASEINFO) {
+            OgreBinary::skipChunk(stream, chunk);
+            continue;
+        }
+        if(chunk.id != OgreBinary::SKELETON_ANIMATION_TRACK) {
+            OgreBinary::unreadChunk(stream);
+            break;
+        }
+
+        Track track;
+        track.bone = boneNames.value((unsigned short)stream.readShort());
+
+        // Time, rotation as x, y, z, w and translation of every keyframe,
+        // decoded into one array before the keyframes are built.
+        QVector<float> frames((chunk.end - stream.pos()) / MIN_KEYFRAME_CHUNK_SIZE * 8);
+        int count = 0;
+        OgreBinary::Chunk keyframe;
+        while(OgreBinary::readChunk(stream, keyframe)) {
+            if(keyframe.id != OgreBinary::SKELETON_ANIMATION_TRACK_KEYFRAME || count * 8 >= frames.size()) {
+                OgreBinary::unreadChunk(stream);
+                break;
+            }
+            stream.readArray(frames.data() + count * 8, 8);
+            count++;
+            OgreBinary::skipChunk(stream, keyframe);
+        }
+
+        track.keyframes.reserve(count);
+        const float *f = frames.constData();
+        for(int i = 0; i < count; i++, f += 8) {
+            Keyframe kf;
+            kf.time = f[0];
+            kf.rotation = QQuaternion(f[4], f[1], f[2], f[3]).normalized();
+            kf.translation = QVector3D(f[5], f[6], f[7]);
+            track.keyframes.append(kf);
+        }
+
+        tracks.append(track);
+        OgreBinary::skipChunk(stream, chunk);
+    }
+}
+
+// Time, translation and rotation of every keyframe
+const int CACHED_FLOATS_PER_KEYFRAME = 8;
+
+void Animation::writeClip(LxStream &stream) const {
+    AssetCache::writeString(stream, animationName);
+    stream.writeInt(fps);
+    stream.writeFloat(length);
+    stream.writeInt(tracks.length());
+    for(const Track &track : tracks) {
+        AssetCache::writeString(stream, track.bone);
+
+        QVector<float> frames(track.keyframes.length() * CACHED_FLOATS_PER_KEYFRAME);
+        float *f = frames.data();
+        for(const Keyframe &kf : track.keyframes) {
+            *f++ = kf.time;
+            *f++ = kf.translation.x();
+            *f++ = kf.translation.y();
+            *f++ = kf.translation.z();
+            *f++ = kf.rotation.scalar();
+            *f++ = kf.rotation.x();
+            *f++ = kf.rotation.y();
+            *f++ = kf.rotation.z();
+        }
+        stream.writeInt(track.keyframes.length());
+        stream.writeArray(frames.constData(), frames.size());
+    }
+}
+
+void Animation::writeCache(LxStream &stream) const {
+    writeClip(stream);
+    skeleton.writeCache(stream);
+}
+
+void Animation::readClip(LxStream &stream) {
+    animationName = AssetCache::readString(stream);
+    fps = stream.readInt();
+    length = stream.readFloat();
+    int count = stream.readInt();
+    tracks.reserve(count);
+    for(int i = 0; i < count; i++) {
+        Track track;
+        track.bone = AssetCache::readString(stream);
+
+        QVector<float> frames(stream.readInt() * CACHED_FLOATS_PER_KEYFRAME);
+        stream.readArray(frames.data(), frames.size());
+        track.keyframes.reserve(frames.size() / CACHED_FLOATS_PER_KEYFRAME);
+        for(const float *f = frames.constData(); f < frames.constData() + frames.size(); f += CACHED_FLOATS_PER_KEYFRAME) {
+            Keyframe kf;
+            kf.time = f[0];
+            kf.translation = QVector3D(f[1], f[2], f[3]);
+            kf.rotation = QQuaternion(f[4], f[5], f[6], f[7]);
+            track.keyframes.append(kf);
+        }
+
+        tracks.append(track);
+    }
+}
+
+void Animation::readCache(LxStream &stream) {
+    readClip(stream);
+    skeleton.readCache(stream);
+}
+
+QString Animation::name() const {
+    return animationName;
+}
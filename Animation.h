@@ -8,6 +8,9 @@
 #include "Skeleton.h"
 
 class LxStream;
+namespace ParallelXml { struct Document; }
+namespace Gltf { struct File; }
+class LxBatchWriter;
 
 struct Keyframe {
     float time;
@@ -51,19 +54,48 @@ struct ExtraData {
     QString toString() const;
 };
 
+// One animation of a bundled skeleton file and where to export it
+struct AnimationExport {
+    QString animation;
+    QString filepath;
+    ExtraData extraData;
+};
+
 class Animation
 {
 public:
     Animation();
-    static Animation fromFile(QString filename);
+    static Animation fromFile(QString filename, bool parallel = false, const QString &animationName = QString());
+    static QList<Animation> allFromFile(QString filename, bool parallel = false);
     static Animation dummy();
-    void exportAnm(QString filepath);
+    static void exportAll(const QList<Animation> &animations, const Skeleton &bindPose,
+                          const QList<AnimationExport> &exports, LxBatchWriter *batch = 0);
+    void exportAnm(QString filepath, LxBatchWriter *batch = 0);
     void applyBindPose(Skeleton sk);
     void setExtraData(ExtraData d);
+    QString name() const;
 
 private:
     void writeHeader(LxStream &stream);
-
+    void readBinaryAnimation(LxStream &stream);
+    static Skeleton parseFile(QString filename, bool parallel, const QString &animationName, bool all,
+                              QList<Animation> &animations);
+    static Skeleton parseBinaryFile(QString filename, const QString &animationName, bool all,
+                                    QList<Animation> &animations);
+    static Skeleton parseGltfFile(QString filename, const QString &animationName, bool all,
+                                  QList<Animation> &animations);
+    void readGltfAnimation(Gltf::File &file, int index);
+    template <typename Reader>
+    static bool readDocument(Reader &xml, const ParallelXml::Document *cuts, const QString &animationName,
+                             bool all, SkeletonSections &sections, QList<Animation> &animations);
+    template <typename Reader>
+    bool readAnimation(Reader &xml, const ParallelXml::Document *cuts);
+    void writeClip(LxStream &stream) const;
+    void readClip(LxStream &stream);
+    void writeCache(LxStream &stream) const;
+    void readCache(LxStream &stream);
+
+    QString animationName;
     int fps;
     float length;
 
@@ -0,0 +1,141 @@
+#include "AssetCache.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include "LxStream.h"
+
+const int CACHE_MAGIC = 0x4341584C; // "LXAC"
+
+// Bump this whenever the parsers or the cached layout change.
+const int CACHE_VERSION = 4;
+
+// Magic, version, source hash, payload size and payload hash
+const int HEADER_SIZE = 4 + 4 + 16 + 8 + 16;
+
+// Empty while caching is off
+static QString cacheDirectory;
+
+static QByteArray hashData(const char *data, qint64 size) {
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(data, size);
+    return hash.result();
+}
+
+// Creates the directory if needed. An empty path turns caching off.
+void AssetCache::setDirectory(const QString &path) {
+    cacheDirectory.clear();
+    if(path.isEmpty()) {
+        return;
+    }
+    if(!QDir().mkpath(path)) {
+        qDebug() << "Couldn't create the cache directory" << path;
+        return;
+    }
+    cacheDirectory = QDir(path).absolutePath();
+}
+
+bool AssetCache::isEnabled() {
+    return !cacheDirectory.isEmpty();
+}
+
+// The source isn't even hashed while caching is off.
+AssetCache::AssetCache(const QString &source, const QString &kind) {
+    if(!isEnabled()) {
+        return;
+    }
+
+    // Sources with the same name in different directories get their own caches
+    QFileInfo info(source);
+    QByteArray path = info.absoluteFilePath().toUtf8();
+    QString pathHash = QString::fromLatin1(hashData(path.constData(), path.size()).toHex().left(16));
+    cachePath = cacheDirectory + "/" + pathHash + "-" + info.fileName() + "." + kind + ".cache";
+
+    QFile file(source);
+    if(!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    uchar *data = file.map(0, file.size());
+    if(data) {
+        sourceHash = hashData((const char *)data, file.size());
+        file.unmap(data);
+    } else {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(&file);
+        sourceHash = hash.result();
+    }
+}
+
+// Returns false if there is no valid cache for the current source.
+bool AssetCache::load(LxStream &stream) {
+    if(sourceHash.isEmpty()) {
+        return false;
+    }
+
+    cacheFile.setFileName(cachePath);
+    if(!cacheFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    qint64 size = cacheFile.size();
+    char *data = size >= HEADER_SIZE ? (char *)cacheFile.map(0, size) : 0;
+    if(!data) {
+        cacheFile.close();
+        return false;
+    }
+
+    LxStream header;
+    header.openData(data, HEADER_SIZE);
+    header.setEndianness(LxStream::LittleEndian);
+    int magic = header.readInt();
+    int version = header.readInt();
+    QByteArray hash = header.readByteArray(16);
+    long long payloadSize = header.readInt64();
+    QByteArray payloadHash = header.readByteArray(16);
+
+    if(magic != CACHE_MAGIC || version != CACHE_VERSION || hash != sourceHash
+            || payloadSize != size - HEADER_SIZE
+            || payloadHash != hashData(data + HEADER_SIZE, payloadSize)) {
+        cacheFile.unmap((uchar *)data);
+        cacheFile.close();
+        return false;
+    }
+
+    stream.openData(data + HEADER_SIZE, payloadSize);
+    stream.setEndianness(LxStream::LittleEndian);
+    return true;
+}
+
+bool AssetCache::store(const QByteArray &payload) {
+    if(sourceHash.isEmpty()) {
+        return false;
+    }
+
+    LxStream stream;
+    stream.openAtomicFile(cachePath, HEADER_SIZE + payload.size());
+    stream.setEndianness(LxStream::LittleEndian);
+    stream.writeInt(CACHE_MAGIC);
+    stream.writeInt(CACHE_VERSION);
+    stream.writeByteArray(sourceHash);
+    stream.writeInt64(payload.size());
+    stream.writeByteArray(hashData(payload.constData(), payload.size()));
+    stream.writeByteArray(payload);
+
+    if(!stream.close()) {
+        qDebug() << "Couldn't write" << cachePath;
+        return false;
+    }
+    return true;
+}
+
+// UTF-8 with a length prefix, so that any name survives the round trip.
+void AssetCache::writeString(LxStream &stream, const QString &str) {
+    QByteArray utf8 = str.toUtf8();
+    stream.writeInt(utf8.size());
+    stream.writeByteArray(utf8);
+}
+
+QString AssetCache::readString(LxStream &stream) {
+    int length = stream.readInt();
+    return QString::fromUtf8(stream.readByteArray(length));
+}
@@ -0,0 +1,41 @@
+#ifndef ASSETCACHE_H
+#define ASSETCACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+
+class LxStream;
+
+// Binary cache of a parsed source file. Caching is off until a directory
+// is set with setDirectory(); the caches are then kept there as
+// "<path hash>-<source name>.<kind>.cache", so asset trees are never
+// written to. The cache is keyed by a hash of the source's content and
+// CACHE_VERSION, and its payload is checksummed, so a stale or damaged
+// cache is simply parsed again.
+//
+// load() maps the cache and opens the stream on the payload; the mapping
+// lives as long as the AssetCache. store() writes a new payload atomically.
+// Callers only store results that parsed, so that a failed parse is retried
+// and reports its error on every run.
+class AssetCache
+{
+public:
+    AssetCache(const QString &source, const QString &kind);
+
+    bool load(LxStream &stream);
+    bool store(const QByteArray &payload);
+
+    static void setDirectory(const QString &path);
+    static bool isEnabled();
+
+    static void writeString(LxStream &stream, const QString &str);
+    static QString readString(LxStream &stream);
+
+private:
+    QString cachePath;
+    QByteArray sourceHash;
+    QFile cacheFile;
+};
+
+#endif // ASSETCACHE_H
@@ -0,0 +1,336 @@
+#include "Gltf.h"
+
+#include <QJsonDocument>
+#include <QMatrix3x3>
+#include <QSet>
+#include <QDebug>
+#include <climits>
+#include <string.h>
+
+namespace {
+    const unsigned int GLB_MAGIC = 0x46546C67; // "glTF"
+    const unsigned int CHUNK_JSON = 0x4E4F534A;
+    const unsigned int CHUNK_BIN = 0x004E4942;
+
+    // Where the elements of an accessor are in the mapping
+    struct AccessorView {
+        const char *data;
+        int count;
+        int components;
+        int componentType;
+        int componentSize;
+        int stride;
+        bool normalized;
+    };
+
+    int componentSize(int type) {
+        switch(type) {
+        case Gltf::BYTE:
+        case Gltf::UNSIGNED_BYTE:
+            return 1;
+        case Gltf::SHORT:
+        case Gltf::UNSIGNED_SHORT:
+            return 2;
+        case Gltf::UNSIGNED_INT:
+        case Gltf::FLOAT:
+            return 4;
+        }
+        return 0;
+    }
+
+    int componentCount(const QString &type) {
+        if(type == "SCALAR") return 1;
+        if(type == "VEC2") return 2;
+        if(type == "VEC3") return 3;
+        if(type == "VEC4" || type == "MAT2") return 4;
+        if(type == "MAT3") return 9;
+        if(type == "MAT4") return 16;
+        return 0;
+    }
+
+    // glTF data is always little-endian
+    template <typename T> T load(const char *p) {
+        char swapped[sizeof(T)];
+        if(LX_HOST_ENDIANNESS == LxStream::BigEndian) {
+            for(size_t i = 0; i < sizeof(T); i++) {
+                swapped[i] = p[sizeof(T) - 1 - i];
+            }
+            p = swapped;
+        }
+        T v;
+        memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    float loadFloat(const char *p, int type, bool normalized) {
+        switch(type) {
+        case Gltf::BYTE:
+            return normalized ? qMax(*(const signed char*)p / 127.0f, -1.0f) : *(const signed char*)p;
+        case Gltf::UNSIGNED_BYTE:
+            return normalized ? *(const unsigned char*)p / 255.0f : *(const unsigned char*)p;
+        case Gltf::SHORT:
+            return normalized ? qMax(load<short>(p) / 32767.0f, -1.0f) : load<short>(p);
+        case Gltf::UNSIGNED_SHORT:
+            return normalized ? load<unsigned short>(p) / 65535.0f : load<unsigned short>(p);
+        case Gltf::UNSIGNED_INT:
+            return load<unsigned int>(p);
+        }
+        return load<float>(p);
+    }
+
+    int loadInt(const char *p, int type) {
+        switch(type) {
+        case Gltf::BYTE:
+            return *(const signed char*)p;
+        case Gltf::UNSIGNED_BYTE:
+            return *(const unsigned char*)p;
+        case Gltf::SHORT:
+            return load<short>(p);
+        case Gltf::UNSIGNED_SHORT:
+            return load<unsigned short>(p);
+        }
+        return (int)load<unsigned int>(p);
+    }
+
+    // Checks the accessor against its buffer view and the BIN chunk and
+    // points the view at its first element. Accessors without a buffer view
+    // are all zeros and get no data pointer.
+    bool openAccessor(Gltf::File &file, int accessor, AccessorView &view) {
+        QJsonObject a = Gltf::object(file, "accessors", accessor);
+        view.data = 0;
+        view.count = a.value("count").toInt(-1);
+        view.components = componentCount(a.value("type").toString());
+        view.componentType = a.value("componentType").toInt();
+        view.componentSize = componentSize(view.componentType);
+        view.normalized = a.value("normalized").toBool();
+
+        int elementSize = view.components * view.componentSize;
+        view.stride = elementSize;
+        if(view.count < 0 || elementSize == 0) {
+            qDebug() << "Invalid accessor" << accessor;
+            return false;
+        }
+        if(a.contains("sparse")) {
+            qDebug() << "Sparse accessors are not supported";
+            return false;
+        }
+        if(!a.contains("bufferView")) {
+            return true;
+        }
+
+        QJsonObject bufferView = Gltf::object(file, "bufferViews", a.value("bufferView").toInt());
+        if(bufferView.isEmpty() || bufferView.value("buffer").toInt() != 0 || file.binLength == 0) {
+            qDebug() << "Accessor" << accessor << "is not in the file's BIN chunk";
+            return false;
+        }
+
+        view.stride = bufferView.value("byteStride").toInt(elementSize);
+        long long viewOffset = (long long)bufferView.value("byteOffset").toDouble();
+        long long viewLength = (long long)bufferView.value("byteLength").toDouble();
+        long long offset = (long long)a.value("byteOffset").toDouble();
+        long long length = view.count == 0 ? 0 : (long long)(view.count - 1) * view.stride + elementSize;
+        if(view.stride < elementSize || viewOffset < 0 || offset < 0 || viewOffset + viewLength > file.binLength
+                || offset + length > viewLength || length > INT_MAX) {
+            qDebug() << "Accessor" << accessor << "doesn't fit its buffer view";
+            return false;
+        }
+
+        file.stream.seek(file.binStart + viewOffset + offset);
+        return file.stream.peekData(&view.data, length) == length;
+    }
+}
+
+// Maps the file and parses its JSON chunk. The BIN chunk stays in the
+// mapping, only its position is kept.
+bool Gltf::openFile(File &file, const QString &filename) {
+    LxStream &stream = file.stream;
+    stream.openMappedFile(filename, LxStream::ReadOnly);
+    if(!stream.isOpen()) {
+        qDebug() << "Couldn't open file.";
+        return false;
+    }
+    stream.setEndianness(LxStream::LittleEndian);
+
+    if(stream.size() < 12 || (unsigned int)stream.readInt() != GLB_MAGIC) {
+        qDebug() << filename << "is not a binary glTF file.";
+        return false;
+    }
+    if(stream.readInt() != 2) {
+        qDebug() << filename << "is not a glTF 2.0 file.";
+        return false;
+    }
+
+    long long length = qMin((long long)(unsigned int)stream.readInt(), stream.size());
+    bool gotJson = false;
+    while(length - stream.pos() >= 8) {
+        long long chunkLength = (unsigned int)stream.readInt();
+        unsigned int type = stream.readInt();
+        long long start = stream.pos();
+        if(chunkLength > length - start) {
+            qDebug() << "Invalid glTF chunk at" << start - 8;
+            return false;
+        }
+
+        if(type == CHUNK_JSON && !gotJson) {
+            QJsonParseError error;
+            QJsonDocument doc = QJsonDocument::fromJson(stream.readByteArray(chunkLength), &error);
+            if(error.error != QJsonParseError::NoError) {
+                qDebug() << "Couldn't parse" << filename << ":" << error.errorString();
+                return false;
+            }
+            file.json = doc.object();
+            gotJson = true;
+        } else if(type == CHUNK_BIN && file.binLength == 0) {
+            file.binStart = start;
+            file.binLength = chunkLength;
+        }
+        stream.seek(start + chunkLength);
+    }
+
+    if(!gotJson) {
+        qDebug() << filename << "has no JSON chunk.";
+    }
+    return gotJson;
+}
+
+// Returns an empty object if the index is out of range.
+QJsonObject Gltf::object(const File &file, const QString &array, int index) {
+    QJsonArray a = file.json.value(array).toArray();
+    if(index < 0 || index >= a.size()) {
+        return QJsonObject();
+    }
+    return a.at(index).toObject();
+}
+
+// Decodes an accessor into floats, count * components of them. Normalized
+// integers are mapped to [0, 1] or [-1, 1].
+bool Gltf::readFloats(File &file, int accessor, QVector<float> &values, int &components) {
+    AccessorView view;
+    if(!openAccessor(file, accessor, view)) {
+        return false;
+    }
+    components = view.components;
+    values.fill(0, view.count * view.components);
+    if(!view.data) {
+        return true;
+    }
+
+    int elementSize = view.components * view.componentSize;
+    if(view.componentType == FLOAT && view.stride == elementSize && LX_HOST_ENDIANNESS == LxStream::LittleEndian) {
+        memcpy(values.data(), view.data, values.size() * sizeof(float));
+        return true;
+    }
+
+    float *v = values.data();
+    for(int i = 0; i < view.count; i++) {
+        const char *element = view.data + (long long)i * view.stride;
+        for(int c = 0; c < view.components; c++) {
+            *v++ = loadFloat(element + c * view.componentSize, view.componentType, view.normalized);
+        }
+    }
+    return true;
+}
+
+// Decodes an accessor of integer components, like indices and joints.
+bool Gltf::readInts(File &file, int accessor, QVector<int> &values, int &components) {
+    AccessorView view;
+    if(!openAccessor(file, accessor, view)) {
+        return false;
+    }
+    if(view.componentType == FLOAT) {
+        qDebug() << "Accessor" << accessor << "doesn't hold integers";
+        return false;
+    }
+    components = view.components;
+    values.fill(0, view.count * view.components);
+    if(!view.data) {
+        return true;
+    }
+
+    int *v = values.data();
+    for(int i = 0; i < view.count; i++) {
+        const char *element = view.data + (long long)i * view.stride;
+        for(int c = 0; c < view.components; c++) {
+            *v++ = loadInt(element + c * view.componentSize, view.componentType);
+        }
+    }
+    return true;
+}
+
+// Scale is dropped, the bones only carry a position and an orientation.
+Gltf::Transform Gltf::nodeTransform(const QJsonObject &node) {
+    Transform t;
+
+    QJsonArray matrix = node.value("matrix").toArray();
+    if(matrix.size() == 16) {
+        // Column-major, with the scale taken out of the rotation columns
+        float m[9];
+        for(int col = 0; col < 3; col++) {
+            QVector3D axis(matrix.at(col * 4).toDouble(),
+                           matrix.at(col * 4 + 1).toDouble(),
+                           matrix.at(col * 4 + 2).toDouble());
+            axis.normalize();
+            m[col] = axis.x();
+            m[3 + col] = axis.y();
+            m[6 + col] = axis.z();
+        }
+        t.translation = QVector3D(matrix.at(12).toDouble(), matrix.at(13).toDouble(), matrix.at(14).toDouble());
+        t.rotation = QQuaternion::fromRotationMatrix(QMatrix3x3(m)).normalized();
+        return t;
+    }
+
+    QJsonArray translation = node.value("translation").toArray();
+    if(translation.size() == 3) {
+        t.translation = QVector3D(translation.at(0).toDouble(), translation.at(1).toDouble(), translation.at(2).toDouble());
+    }
+
+    // Stored as x, y, z, w
+    QJsonArray rotation = node.value("rotation").toArray();
+    if(rotation.size() == 4) {
+        t.rotation = QQuaternion(rotation.at(3).toDouble(), rotation.at(0).toDouble(),
+                                 rotation.at(1).toDouble(), rotation.at(2).toDouble()).normalized();
+    }
+    return t;
+}
+
+// The skin of the first node that has both a mesh and a skin, falling back
+// to the first skin and mesh of the file. -1 if there is none.
+int Gltf::findSkin(const File &file, int *mesh) {
+    QJsonArray nodes = file.json.value("nodes").toArray();
+    for(const QJsonValue &value : nodes) {
+        QJsonObject node = value.toObject();
+        if(node.contains("mesh") && node.contains("skin")) {
+            if(mesh) {
+                *mesh = node.value("mesh").toInt();
+            }
+            return node.value("skin").toInt();
+        }
+    }
+
+    if(mesh) {
+        *mesh = file.json.value("meshes").toArray().isEmpty() ? -1 : 0;
+    }
+    return file.json.value("skins").toArray().isEmpty() ? -1 : 0;
+}
+
+// Bone names of the skin's joints by node index. Unnamed joints are called
+// after their joint index, repeated names get the node index appended.
+QHash<int, QString> Gltf::jointNames(const File &file, int skin) {
+    QHash<int, QString> names;
+    QSet<QString> used;
+
+    QJsonArray joints = object(file, "skins", skin).value("joints").toArray();
+    for(int i = 0; i < joints.size(); i++) {
+        int node = joints.at(i).toInt();
+        QString name = object(file, "nodes", node).value("name").toString();
+        if(name.isEmpty()) {
+            name = "joint" + QString::number(i);
+        }
+        if(used.contains(name)) {
+            name += "_" + QString::number(node);
+        }
+        used.insert(name);
+        names.insert(node, name);
+    }
+    return names;
+}
@@ -0,0 +1,57 @@
+#ifndef GLTF_H
+#define GLTF_H
+
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+#include <QQuaternion>
+#include "LxStream.h"
+
+// Helpers for binary glTF 2.0 (.glb) files. The JSON chunk is parsed once,
+// accessors are decoded straight out of the mapped BIN chunk.
+namespace Gltf {
+    enum ComponentType {
+        BYTE = 5120,
+        UNSIGNED_BYTE = 5121,
+        SHORT = 5122,
+        UNSIGNED_SHORT = 5123,
+        UNSIGNED_INT = 5125,
+        FLOAT = 5126
+    };
+
+    enum PrimitiveMode {
+        TRIANGLES = 4
+    };
+
+    struct File {
+        File() : binStart(0), binLength(0) {}
+
+        LxStream stream;
+        QJsonObject json;
+        long long binStart;
+        long long binLength;
+
+    private:
+        File(const File &);
+        File &operator=(const File &);
+    };
+
+    // The local transform of a node, from either its TRS or its matrix
+    struct Transform {
+        QVector3D translation;
+        QQuaternion rotation;
+    };
+
+    bool openFile(File &file, const QString &filename);
+    QJsonObject object(const File &file, const QString &array, int index);
+    bool readFloats(File &file, int accessor, QVector<float> &values, int &components);
+    bool readInts(File &file, int accessor, QVector<int> &values, int &components);
+    Transform nodeTransform(const QJsonObject &node);
+    int findSkin(const File &file, int *mesh = 0);
+    QHash<int, QString> jointNames(const File &file, int skin);
+}
+
+#endif // GLTF_H
@@ -0,0 +1,512 @@
+#ifndef LXBATCHWRITER_H
+#define LXBATCHWRITER_H
+
+#include "LxStream.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#if defined(__linux__)
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define LX_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#endif
+#endif
+
+// Collects whole files in memory and writes them to disk in batches. On
+// Linux the opens, writes and closes of a batch are submitted through
+// io_uring, everywhere else (or if io_uring is unavailable) a pool of
+// threads writes the files. Like LxAtomicFileStream, every file goes to
+// <filename>.tmp first and only replaces the target once it is complete.
+class LxBatchWriter
+{
+public:
+    LxBatchWriter(int threads = 0);
+    ~LxBatchWriter();
+
+    void open(LxStream &stream, const char *filename, long long reserveSize = 0);
+#ifdef USE_QT
+    void open(LxStream &stream, QString filename, long long reserveSize = 0);
+#endif
+    void add(const std::string &filename, std::vector<char> &data);
+    bool flush();
+    int pending() const;
+
+private:
+    struct Entry {
+        std::string filename;
+        std::string temp;
+        std::vector<char> data;
+        bool ok;
+    };
+
+    bool writeUring(std::vector<Entry> &entries);
+#ifdef LX_HAVE_IO_URING
+    void abandonGroup(std::vector<Entry> &entries, size_t first, unsigned n, std::vector<int> &fds);
+#endif
+    void writeThreaded(std::vector<Entry> &entries, size_t first = 0);
+
+    std::vector<Entry> queue;
+    mutable std::mutex mutex;
+    int threads;
+
+    // disable copies:
+    LxBatchWriter(const LxBatchWriter &);
+    LxBatchWriter &operator=(const LxBatchWriter &);
+};
+
+// Keeps a file in memory and hands it to an LxBatchWriter on close().
+class LxBatchFileStream : public LxMemoryStream
+{
+public:
+    LxBatchFileStream(LxBatchWriter *batch, const std::string &filename, long long reserveSize = 0);
+    virtual ~LxBatchFileStream();
+    virtual void close();
+    virtual bool isOpen() const { return m_isOpen; }
+private:
+    LxBatchWriter *batch;
+    std::string filename;
+    bool m_isOpen;
+};
+
+#ifdef LX_HAVE_IO_URING
+
+// Minimal io_uring submission/completion ring on top of the raw syscalls.
+class LxUring
+{
+public:
+    LxUring() : fd(-1) {}
+    ~LxUring() { destroy(); }
+    bool init(unsigned entries);
+    void destroy();
+    unsigned capacity() const { return sqEntries; }
+    io_uring_sqe *nextSqe();
+    bool submitAndWait(unsigned count);
+    unsigned unsubmitted() const;
+    bool popCqe(io_uring_cqe &cqe);
+
+private:
+    int fd;
+    unsigned sqEntries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned queued;
+};
+
+inline bool LxUring::init(unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0)
+        return false;
+
+    sqEntries = p.sq_entries;
+    queued = 0;
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMap && cqRingSize > sqRingSize)
+        sqRingSize = cqRingSize;
+
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = singleMap ? sqRing : mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        destroy();
+        return false;
+    }
+
+    char *sq = (char *)sqRing;
+    sqHead = (unsigned *)(sq + p.sq_off.head);
+    sqTail = (unsigned *)(sq + p.sq_off.tail);
+    sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + p.cq_off.head);
+    cqTail = (unsigned *)(cq + p.cq_off.tail);
+    cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+inline void LxUring::destroy()
+{
+    if(fd < 0)
+        return;
+    if(sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if(cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if(sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    ::close(fd);
+    fd = -1;
+}
+
+// Returns a cleared submission entry, or 0 if the ring is full.
+inline io_uring_sqe *LxUring::nextSqe()
+{
+    unsigned tail = *sqTail + queued;
+    if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        return 0;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    queued++;
+    return sqe;
+}
+
+// Submits the queued entries and waits for count completions. Interrupted
+// and temporarily refused calls are retried, and so are entries the kernel
+// didn't take yet. Returns false on any other error; unsubmitted() then
+// tells how many of the last entries never reached the kernel.
+inline bool LxUring::submitAndWait(unsigned count)
+{
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+    while(true) {
+        unsigned toSubmit = unsubmitted();
+        int ret = syscall(__NR_io_uring_enter, fd, toSubmit, count, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret >= 0 && (unsigned)ret == toSubmit)
+            return true;
+        if(ret < 0 && errno != EINTR && errno != EAGAIN)
+            return false;
+    }
+}
+
+// Entries in the ring that the kernel hasn't consumed, always the newest ones.
+inline unsigned LxUring::unsubmitted() const
+{
+    return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+}
+
+inline bool LxUring::popCqe(io_uring_cqe &cqe)
+{
+    unsigned head = *cqHead;
+    if(head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif // LX_HAVE_IO_URING
+
+
+
+
+
+
+
+
+
+inline LxBatchWriter::LxBatchWriter(int threads)
+{
+    if(threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    this->threads = threads > 0 ? threads : 1;
+}
+
+inline LxBatchWriter::~LxBatchWriter()
+{
+    flush();
+}
+
+inline void LxBatchWriter::open(LxStream &stream, const char *filename, long long reserveSize)
+{
+    stream.openDevice(new LxBatchFileStream(this, filename, reserveSize));
+}
+
+#ifdef USE_QT
+inline void LxBatchWriter::open(LxStream &stream, QString filename, long long reserveSize)
+{
+    open(stream, QFile::encodeName(filename).constData(), reserveSize);
+}
+#endif
+
+// Queues a finished file. Takes the contents of data.
+inline void LxBatchWriter::add(const std::string &filename, std::vector<char> &data)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(Entry());
+    queue.back().filename = filename;
+    queue.back().temp = filename + ".tmp";
+    queue.back().data.swap(data);
+    queue.back().ok = false;
+}
+
+inline int LxBatchWriter::pending() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+}
+
+// Writes all queued files. Returns false if any of them failed.
+inline bool LxBatchWriter::flush()
+{
+    std::vector<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.swap(queue);
+    }
+    if(entries.empty())
+        return true;
+
+    if(!writeUring(entries))
+        writeThreaded(entries);
+
+    bool ok = true;
+    for(const Entry &e : entries) {
+        if(!e.ok) {
+            error(("LxBatchWriter: Couldn't write " + e.filename).c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+#ifdef LX_HAVE_IO_URING
+
+// Opens, writes and closes the files in groups of the ring size. Returns
+// false if io_uring isn't usable, in which case nothing has been written.
+inline bool LxBatchWriter::writeUring(std::vector<Entry> &entries)
+{
+    LxUring ring;
+    if(!ring.init(64))
+        return false;
+
+    const unsigned group = ring.capacity();
+    std::vector<int> fds(group);
+    std::vector<size_t> written(group);
+    std::vector<char> opened(group);
+    std::vector<unsigned> closing(group);
+    io_uring_cqe cqe;
+
+    for(size_t first = 0; first < entries.size(); first += group) {
+        unsigned n = entries.size() - first < group ? entries.size() - first : group;
+
+        for(unsigned i = 0; i < n; i++) {
+            io_uring_sqe *sqe = ring.nextSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long long)entries[first + i].temp.c_str();
+            sqe->len = 0666;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            sqe->user_data = i;
+        }
+        if(!ring.submitAndWait(n)) {
+            if(first == 0)
+                return false;
+            writeThreaded(entries, first);
+            return true;
+        }
+        bool unsupported = false;
+        bool failed = false;
+        std::fill(fds.begin(), fds.end(), -1);
+        std::fill(opened.begin(), opened.end(), 0);
+        for(unsigned done = 0; done < n; ) {
+            if(!ring.popCqe(cqe)) {
+                if(!ring.submitAndWait(1)) {
+                    failed = true;
+                    break;
+                }
+                continue;
+            }
+            fds[cqe.user_data] = cqe.res;
+            opened[cqe.user_data] = cqe.res >= 0;
+            written[cqe.user_data] = 0;
+            if(cqe.res == -EINVAL)
+                unsupported = true;
+            done++;
+        }
+        if(unsupported && first == 0) {
+            // Kernel without IORING_OP_OPENAT, leave everything to the threads
+            for(unsigned i = 0; i < n; i++) {
+                if(fds[i] >= 0)
+                    ::close(fds[i]);
+            }
+            return false;
+        }
+        if(failed) {
+            abandonGroup(entries, first, n, fds);
+            return true;
+        }
+
+        // Writes, resubmitting whatever was written short
+        unsigned outstanding = 0;
+        for(unsigned i = 0; i < n; i++) {
+            if(fds[i] < 0)
+                continue;
+            const std::vector<char> &d = entries[first + i].data;
+            if(d.empty()) {
+                entries[first + i].ok = true;
+                continue;
+            }
+            io_uring_sqe *sqe = ring.nextSqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fds[i];
+            sqe->addr = (unsigned long long)d.data();
+            sqe->len = d.size();
+            sqe->off = 0;
+            sqe->user_data = i;
+            outstanding++;
+        }
+        while(outstanding > 0) {
+            if(!ring.submitAndWait(1)) {
+                abandonGroup(entries, first, n, fds);
+                return true;
+            }
+            while(ring.popCqe(cqe)) {
+                unsigned i = cqe.user_data;
+                const std::vector<char> &d = entries[first + i].data;
+                outstanding--;
+                if(cqe.res <= 0)
+                    continue;
+                written[i] += cqe.res;
+                if(written[i] == d.size()) {
+                    entries[first + i].ok = true;
+                    continue;
+                }
+                io_uring_sqe *sqe = ring.nextSqe();
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = fds[i];
+                sqe->addr = (unsigned long long)(d.data() + written[i]);
+                sqe->len = d.size() - written[i];
+                sqe->off = written[i];
+                sqe->user_data = i;
+                outstanding++;
+            }
+        }
+
+        unsigned closes = 0;
+        for(unsigned i = 0; i < n; i++) {
+            if(fds[i] < 0)
+                continue;
+            io_uring_sqe *sqe = ring.nextSqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i];
+            sqe->user_data = i;
+            closing[closes++] = i;
+        }
+        bool submitted = closes == 0 || ring.submitAndWait(closes);
+
+        // A close the kernel took owns its fd, even if waiting for it failed.
+        // The others are still ours and abandonGroup() closes them.
+        unsigned taken = closes - ring.unsubmitted();
+        for(unsigned k = 0; k < taken; k++)
+            fds[closing[k]] = -1;
+        if(!submitted) {
+            abandonGroup(entries, first, n, fds);
+            return true;
+        }
+        for(unsigned done = 0; done < closes; ) {
+            if(!ring.popCqe(cqe)) {
+                if(!ring.submitAndWait(1)) {
+                    abandonGroup(entries, first, n, fds);
+                    return true;
+                }
+                continue;
+            }
+            if(cqe.res < 0)
+                entries[first + cqe.user_data].ok = false;
+            done++;
+        }
+
+        // Only complete files replace their targets
+        for(unsigned i = 0; i < n; i++) {
+            Entry &e = entries[first + i];
+            if(!opened[i])
+                continue;
+            if(e.ok && !replaceFile(e.temp.c_str(), e.filename.c_str()))
+                e.ok = false;
+            if(!e.ok)
+                unlink(e.temp.c_str());
+        }
+    }
+    return true;
+}
+
+// Gives up on the ring after io_uring_enter failed: the group's files are
+// closed here and everything from its first entry on is left to the
+// threads, which rewrite the whole files.
+inline void LxBatchWriter::abandonGroup(std::vector<Entry> &entries, size_t first, unsigned n, std::vector<int> &fds)
+{
+    for(unsigned i = 0; i < n; i++) {
+        if(fds[i] >= 0)
+            ::close(fds[i]);
+        fds[i] = -1;
+    }
+    for(size_t i = first; i < entries.size(); i++)
+        entries[i].ok = false;
+    writeThreaded(entries, first);
+}
+
+#else
+
+inline bool LxBatchWriter::writeUring(std::vector<Entry> &)
+{
+    return false;
+}
+
+#endif // LX_HAVE_IO_URING
+
+// Writes entries[first..] with plain stdio calls on a pool of threads.
+inline void LxBatchWriter::writeThreaded(std::vector<Entry> &entries, size_t first)
+{
+    std::atomic<size_t> next(first);
+    auto work = [&entries, &next] {
+        for(size_t i = next++; i < entries.size(); i = next++) {
+            Entry &e = entries[i];
+            e.ok = writeFileAtomically(e.filename, e.data.data(), e.data.size());
+        }
+    };
+
+    size_t remaining = entries.size() - first;
+    size_t count = (size_t)threads < remaining ? threads : remaining;
+    std::vector<std::thread> pool;
+    for(size_t i = 1; i < count; i++)
+        pool.push_back(std::thread(work));
+    work();
+    for(std::thread &t : pool)
+        t.join();
+}
+
+inline LxBatchFileStream::LxBatchFileStream(LxBatchWriter *batch, const std::string &filename, long long reserveSize)
+    : LxMemoryStream(reserveSize)
+{
+    this->batch = batch;
+    this->filename = filename;
+    m_isOpen = true;
+}
+
+inline LxBatchFileStream::~LxBatchFileStream()
+{
+    if(isOpen())
+        close();
+}
+
+inline void LxBatchFileStream::close()
+{
+    if(!m_isOpen)
+        return;
+    std::vector<char> data;
+    take(data);
+    batch->add(filename, data);
+    m_isOpen = false;
+}
+
+#endif // LXBATCHWRITER_H
@@ -13,9 +13,33 @@
 #include <QBuffer>
 #include <QDebug>
 #include <QFile>
+#include <QSaveFile>
 #endif
 #include <stack>
+#include <vector>
+#include <string>
 #include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#ifdef _WIN32
+// Keeps the min/max macros and the rarely used APIs out of every includer
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifdef _MSC_VER
     #define BYTESWAP_16 _byteswap_ushort
@@ -27,18 +51,60 @@
     #define BYTESWAP_64 __builtin_bswap64
 #endif
 
+#ifdef _WIN32
+    #define LX_FSEEK _fseeki64
+    #define LX_FTELL _ftelli64
+#else
+    #define LX_FSEEK fseeko
+    #define LX_FTELL ftello
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define LX_HOST_ENDIANNESS LxStream::BigEndian
+#else
+    #define LX_HOST_ENDIANNESS LxStream::LittleEndian
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX__)
+    #define LX_SSSE3
+    #include <tmmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define LX_SSE2
+    #include <emmintrin.h>
+#endif
+
 class LxStreamDevice
 {
+    friend class LxStream;
 public:
+    LxStreamDevice();
     virtual ~LxStreamDevice() = 0;
     virtual void close() = 0;
     virtual char *getData(int length) = 0;
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
     virtual bool isOpen() const = 0;
     virtual void seek(long long newPos) = 0;
     virtual long long pos() const = 0;
     virtual void writeData(const char *data, int length) = 0;
     virtual bool atEnd() const = 0;
     virtual long long size() const = 0;
+    virtual bool hasError() const { return false; }
+
+protected:
+    // Devices that own a write buffer expose its free space here so that
+    // LxStream::write<T> can store small values without a virtual call.
+    char *writePtr;
+    char *writeEnd;
+
+    char *reserveWindow(int length);
+
+private:
+    // Scratch memory backing readData() for devices that can't hand out
+    // pointers into their own storage.
+    char *window;
+    int windowSize;
 };
 
 class LxStream
@@ -71,14 +137,25 @@ public:
         BigEndian = 1
     };
 
+    enum {
+        DefaultBlockSize = 64 * 1024
+    };
+
     LxStream();
 
     ~LxStream();
 
     void openData(char *data, int length);
     void openFile(const char *filename, OpenMode mode);
+    void openMappedFile(const char *filename, OpenMode mode);
+    void openMemory(long long reserveSize = 0);
+    void openAtomicFile(const char *filename, long long reserveSize = 0);
+    void openDevice(LxStreamDevice *d);
 
-    void close();
+    void setBuffered(int blockSize = DefaultBlockSize);
+    void setAsync(int blockSize = DefaultBlockSize);
+
+    bool close();
     bool isOpen() const;
     void seek(long long newPos);
     void skip(int num);
@@ -93,15 +170,23 @@ public:
 
 
     template <typename T> T read() {
-        char* c = device->getData(sizeof(T));
-        T v = *(T*)c;
-        delete c;
+        T v;
+        memcpy(&v, device->readData(sizeof(T)), sizeof(T));
         return v;
     }
 
 
+    // Bulk transfer of count values, swapped to the stream's endianness.
+    template <typename T> int readArray(T *dest, int count);
+    template <typename T> void writeArray(const T *data, int count);
+
     template <typename T> void write(const T d) {
-        device->writeData((const char*)&d, sizeof(T));
+        if(device->writeEnd - device->writePtr >= (long long)sizeof(T)) {
+            memcpy(device->writePtr, &d, sizeof(T));
+            device->writePtr += sizeof(T);
+        } else {
+            device->writeData((const char*)&d, sizeof(T));
+        }
     }
 
     char        readChar();
@@ -111,6 +196,8 @@ public:
     long long   readInt64();
     char *      readZString(int buffersize = 1024);
     char *      readData(int length);
+    int         readInto(char *dest, int length);
+    int         peekData(const char **data, int maxLength);
 
     void writeChar(const char c);
     void writeShort(const short s);
@@ -126,13 +213,15 @@ public:
     LxStream(QByteArray *arr);
 
     void openQFile(QString filename, OpenMode mode);
+    void openMappedFile(QString filename, OpenMode mode);
+    void openAtomicFile(QString filename, long long reserveSize = 0);
     void openByteArray(QByteArray *ba);
     QByteArray readAll();
     QByteArray readByteArray(int length);
     void writeByteArray(QByteArray data);
     QString readQString();
     QString readLine();
-    void writeQString(const QString s);
+    void writeQString(const QString &s);
 #else
     LxStream(const char * filename, OpenMode mode);
 #endif
@@ -140,6 +229,7 @@ public:
 
 private:
     void init();
+    bool needsSwap() const { return endianness != LX_HOST_ENDIANNESS; }
 
     std::stack<long long> positions;
     LxStreamDevice *device;
@@ -150,6 +240,25 @@ private:
     LxStream &operator=(const LxStream &);
 };
 
+// Block of a file read ahead by peekData(), so that scanning strings
+// doesn't read and seek back for every one of them. Holds the bytes at
+// [start, start + data.size()); writes to the file drop it.
+struct LxReadAhead
+{
+    LxReadAhead() : start(0) {}
+
+    // Bytes held from pos on, or 0 if pos isn't in the block
+    int available(long long pos) const {
+        long long end = start + (long long)data.size();
+        return pos >= start && pos < end ? int(end - pos) : 0;
+    }
+    const char *at(long long pos) const { return data.data() + (pos - start); }
+    void clear() { data.clear(); }
+
+    std::vector<char> data;
+    long long start;
+};
+
 class LxFileStream : public LxStreamDevice
 {
 public:
@@ -158,16 +267,28 @@ public:
     virtual void close();
     virtual bool isOpen() const { return m_isOpen; }
     virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
     virtual void seek(long long newPos);
-    virtual long long pos() const;
+    virtual long long pos() const { return position; }
     virtual void writeData(const char *data, int length);
-    virtual bool atEnd() const;
-    virtual long long size() const;
+    virtual bool atEnd() const { return position >= m_size; }
+    virtual long long size() const { return m_size; }
+    virtual bool hasError() const { return m_error; }
 private:
     bool getOpenMode(LxStream::OpenMode mode, char* newMode);
+    void sync();
 
     bool m_isOpen;
+    bool m_error;
     FILE *file;
+    // Cached so that pos(), size() and atEnd() don't need to seek. Seeks
+    // only move position, the FILE follows on the next read or write.
+    long long position;
+    long long filePosition;
+    long long m_size;
+    LxReadAhead ahead;
 };
 
 class LxCharArrayStream : public LxStreamDevice
@@ -178,6 +299,9 @@ public:
     virtual void close() {}
     virtual bool isOpen() const { return true; }
     virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
     virtual void seek(long long newPos);
     virtual long long pos() const { return position; }
     virtual void writeData(const char *data, int length);
@@ -189,6 +313,173 @@ private:
     char *data;
 };
 
+// Maps the whole file into memory. Reads hand out pointers into the mapping,
+// writes are plain stores. In write mode the file is grown by doubling and
+// truncated to the written size on close().
+class LxMappedFileStream : public LxStreamDevice
+{
+public:
+    LxMappedFileStream(const char *filename, LxStream::OpenMode mode);
+    virtual ~LxMappedFileStream();
+    virtual void close();
+    virtual bool isOpen() const { return m_isOpen; }
+    virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
+    virtual void seek(long long newPos);
+    virtual long long pos() const;
+    virtual void writeData(const char *data, int length);
+    virtual bool atEnd() const { return pos() >= size(); }
+    virtual long long size() const;
+    virtual bool hasError() const { return m_error; }
+private:
+    bool map(long long newCapacity);
+    void unmap();
+    bool reserve(long long length);
+
+    bool m_isOpen;
+    bool m_error;
+    bool writable;
+    char *data;
+    long long position; // only used when read only, writePtr is the cursor otherwise
+    long long m_size;
+    long long capacity;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    // disable copies:
+    LxMappedFileStream(const LxMappedFileStream &);
+    LxMappedFileStream &operator=(const LxMappedFileStream &);
+};
+
+// Growable in-memory stream. The buffer doubles when a write or seek goes
+// past it, reserve() takes a hint for the final size up front.
+class LxMemoryStream : public LxStreamDevice
+{
+public:
+    LxMemoryStream(long long reserveSize = 0);
+    virtual ~LxMemoryStream() {}
+    virtual void close() {}
+    virtual bool isOpen() const { return true; }
+    virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
+    virtual void seek(long long newPos);
+    virtual long long pos() const { return writePtr - buffer.data(); }
+    virtual void writeData(const char *data, int length);
+    virtual bool atEnd() const { return pos() >= size(); }
+    virtual long long size() const;
+    void reserve(long long length);
+    const char *constData() const { return buffer.data(); }
+    void take(std::vector<char> &out);
+private:
+    void grow(long long length);
+
+    std::vector<char> buffer;
+    long long m_size;
+};
+
+// Builds the file in memory and on close() writes it with a single call to
+// a temporary file, which is then renamed over the target. Readers never
+// see a partially written file.
+class LxAtomicFileStream : public LxMemoryStream
+{
+public:
+    LxAtomicFileStream(const std::string &filename, long long reserveSize = 0);
+    virtual ~LxAtomicFileStream();
+    virtual void close();
+    virtual bool isOpen() const { return m_isOpen; }
+    virtual bool hasError() const { return m_error; }
+private:
+    bool commit();
+
+    std::string filename;
+    bool m_isOpen;
+    bool m_error;
+};
+
+// Collects writes in a block of memory and hands them to the wrapped device
+// in blockSize chunks. Takes ownership of the wrapped device.
+class LxBufferedStream : public LxStreamDevice
+{
+public:
+    LxBufferedStream(LxStreamDevice *d, int blockSize = LxStream::DefaultBlockSize);
+    virtual ~LxBufferedStream();
+    virtual void close();
+    virtual bool isOpen() const { return device->isOpen(); }
+    virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
+    virtual void seek(long long newPos);
+    virtual long long pos() const;
+    virtual void writeData(const char *data, int length);
+    virtual bool atEnd() const;
+    virtual long long size() const;
+    virtual bool hasError() const { return device->hasError(); }
+    void flush();
+private:
+    LxStreamDevice *device;
+    char *buffer;
+    int blockSize;
+
+    // disable copies:
+    LxBufferedStream(const LxBufferedStream &);
+    LxBufferedStream &operator=(const LxBufferedStream &);
+};
+
+// Double buffered writer: the caller fills one block while a dedicated
+// thread writes the other one to the wrapped device. Seeks and reads wait
+// for the pending block first. Write errors are reported through
+// hasError(). Takes ownership of the wrapped device.
+class LxAsyncWriteStream : public LxStreamDevice
+{
+public:
+    LxAsyncWriteStream(LxStreamDevice *d, int blockSize = LxStream::DefaultBlockSize);
+    virtual ~LxAsyncWriteStream();
+    virtual void close();
+    virtual bool isOpen() const { return device->isOpen(); }
+    virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
+    virtual void seek(long long newPos);
+    virtual long long pos() const { return base + (writePtr - front); }
+    virtual void writeData(const char *data, int length);
+    virtual bool atEnd() const { return pos() >= size(); }
+    virtual long long size() const;
+    virtual bool hasError() const { return m_error; }
+private:
+    void submit();
+    void drain();
+    void run();
+
+    LxStreamDevice *device;
+    char *front;
+    char *back;
+    int blockSize;
+    long long base; // stream position of front[0]
+    long long m_size;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    int pendingSize;
+    bool stopping;
+    std::atomic<bool> m_error;
+
+    // disable copies:
+    LxAsyncWriteStream(const LxAsyncWriteStream &);
+    LxAsyncWriteStream &operator=(const LxAsyncWriteStream &);
+};
+
 #ifdef USE_QT
 
 class LxQFileStream : public LxStreamDevice
@@ -199,14 +490,24 @@ public:
     virtual void close();
     virtual bool isOpen() const;
     virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
     virtual void seek(long long newPos);
     virtual long long pos() const;
     virtual void writeData(const char *data, int length);
     virtual bool atEnd() const;
     virtual long long size() const;
+    virtual bool hasError() const { return m_error; }
 
 private:    
+    void sync();
+
     QFile file;
+    bool m_error;
+    // Like LxFileStream, seeks only move position until the next read or write
+    long long position;
+    LxReadAhead ahead;
 };
 
 
@@ -218,6 +519,9 @@ public:
     virtual void close() {  buf.close(); }
     virtual bool isOpen() const { return buf.isOpen(); }
     virtual char *getData(int length);
+    virtual const char *readData(int length);
+    virtual int readInto(char *dest, int length);
+    virtual int peekData(const char **data, int maxLength);
     virtual void seek(long long newPos);
     virtual long long pos() const { return buf.pos(); }
     virtual void writeData(const char *data, int length);
@@ -247,11 +551,122 @@ inline void error(const char *errorText) {
 #endif
 }
 
+// Renames from over to, replacing the file that is there.
+inline bool replaceFile(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// Writes the data to filename + ".tmp" and renames that over filename. On
+// failure the temporary file is removed and filename is left as it was.
+inline bool writeFileAtomically(const std::string &filename, const char *data, long long length) {
+    std::string temp = filename + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if(file == NULL)
+        return false;
+    bool ok = length == 0 || fwrite(data, 1, length, file) == (size_t)length;
+    if(fclose(file) != 0)
+        ok = false;
+    if(ok)
+        ok = replaceFile(temp.c_str(), filename.c_str());
+    if(!ok)
+        remove(temp.c_str());
+    return ok;
+}
+
+// Byte swaps count elements of elementSize bytes from src into dest.
+// dest and src may be the same buffer.
+inline void byteSwapArray(char *dest, const char *src, int count, int elementSize) {
+    int i = 0;
+    int bytes = count * elementSize;
+#if defined(LX_SSSE3)
+    __m128i mask;
+    if(elementSize == 2)
+        mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    else if(elementSize == 4)
+        mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    else
+        mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    for(; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(LX_SSE2)
+    for(; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if(elementSize == 8)
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+        if(elementSize >= 4)
+            v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dest + i), v);
+    }
+#endif
+    for(; i < bytes; i += elementSize) {
+        for(int j = 0; j < elementSize / 2; j++) {
+            char c = src[i + j];
+            dest[i + j] = src[i + elementSize - 1 - j];
+            dest[i + elementSize - 1 - j] = c;
+        }
+    }
+}
+
 }
 
 
+inline LxStreamDevice::LxStreamDevice()
+{
+    writePtr = 0;
+    writeEnd = 0;
+    window = 0;
+    windowSize = 0;
+}
+
 inline LxStreamDevice::~LxStreamDevice()
 {
+    delete[] window;
+}
+
+inline char *LxStreamDevice::reserveWindow(int length)
+{
+    if(length > windowSize) {
+        delete[] window;
+        windowSize = windowSize * 2 > length ? windowSize * 2 : length;
+        window = new char[windowSize];
+    }
+    return window;
+}
+
+// Fallback for devices that only implement getData()
+
+inline const char *LxStreamDevice::readData(int length)
+{
+    char *d = getData(length);
+    memcpy(reserveWindow(length), d, length);
+    delete[] d;
+    return window;
+}
+
+inline int LxStreamDevice::readInto(char *dest, int length)
+{
+    char *d = getData(length);
+    memcpy(dest, d, length);
+    delete[] d;
+    return length;
+}
+
+// Points data at up to maxLength bytes from the current position without
+// consuming them. Returns the number of bytes available there.
+inline int LxStreamDevice::peekData(const char **data, int maxLength)
+{
+    long long p = pos();
+    int n = readInto(reserveWindow(maxLength), maxLength);
+    seek(p);
+    *data = window;
+    return n;
 }
 
 inline LxStream::LxStream()
@@ -294,9 +709,52 @@ inline void LxStream::openFile(const char *filename, LxStream::OpenMode mode)
     device = new LxFileStream(filename, mode);
 }
 
-inline void LxStream::close()
+inline void LxStream::openMemory(long long reserveSize)
+{
+    if(device != 0)
+        delete device;
+    device = new LxMemoryStream(reserveSize);
+}
+
+inline void LxStream::openAtomicFile(const char *filename, long long reserveSize)
+{
+    if(device != 0)
+        delete device;
+    device = new LxAtomicFileStream(filename, reserveSize);
+}
+
+// Takes ownership of the device.
+inline void LxStream::openDevice(LxStreamDevice *d)
+{
+    if(device != 0)
+        delete device;
+    device = d;
+}
+
+inline void LxStream::setBuffered(int blockSize)
+{
+    if(device != 0)
+        device = new LxBufferedStream(device, blockSize);
+}
+
+inline void LxStream::openMappedFile(const char *filename, LxStream::OpenMode mode)
+{
+    if(device != 0)
+        delete device;
+    device = new LxMappedFileStream(filename, mode);
+}
+
+inline void LxStream::setAsync(int blockSize)
+{
+    if(device != 0)
+        device = new LxAsyncWriteStream(device, blockSize);
+}
+
+// Returns false if any write to the device failed.
+inline bool LxStream::close()
 {
     device->close();
+    return !device->hasError();
 }
 
 inline bool LxStream::isOpen() const
@@ -363,7 +821,7 @@ inline char LxStream::readChar()
 
 inline short LxStream::readShort()
 {
-    if(endianness == BigEndian)
+    if(needsSwap())
         return BYTESWAP_16(read<short>());
     else
         return read<short>();
@@ -371,7 +829,7 @@ inline short LxStream::readShort()
 
 inline int LxStream::readInt()
 {
-    if(endianness == BigEndian)
+    if(needsSwap())
         return BYTESWAP_32(read<int>());
     else
         return read<int>();
@@ -379,7 +837,7 @@ inline int LxStream::readInt()
 
 inline float LxStream::readFloat()
 {
-    if(endianness == BigEndian) {
+    if(needsSwap()) {
         float f = read<float>();
         int bf = BYTESWAP_32((int&)f);
         return (float&)bf;
@@ -390,7 +848,7 @@ inline float LxStream::readFloat()
 
 inline long long LxStream::readInt64()
 {
-    if(endianness == BigEndian)
+    if(needsSwap())
         return BYTESWAP_64(read<long long>());
     else
         return read<long long>();
@@ -399,23 +857,28 @@ inline long long LxStream::readInt64()
 inline char *LxStream::readZString(int bufferSize)
 {
     char *str = new char[bufferSize];
-    char c = -1;
     int p = 0;
-    while(!atEnd() && p < bufferSize) {
-        c = read<char>();
-        str[p] = c;
-        p++;
-        if(c == 0) {
+    while(p < bufferSize) {
+        const char *d;
+        int n = device->peekData(&d, bufferSize - p);
+        if(n <= 0)
+            break;
+        const char *end = (const char *)memchr(d, 0, n);
+        int length = end ? end - d + 1 : n;
+        memcpy(str + p, d, length);
+        skip(length);
+        p += length;
+        if(end) {
             char *newStr = new char[p];
             memcpy(newStr, str, p);
-            delete str;
+            delete[] str;
             return newStr;
         }
     }
     if(p == bufferSize)
         return str;
-    else
-        return 0;
+    delete[] str;
+    return 0;
 }
 
 inline char *LxStream::readData(int length)
@@ -423,14 +886,21 @@ inline char *LxStream::readData(int length)
     return device->getData(length);
 }
 
+inline int LxStream::readInto(char *dest, int length)
+{
+    return device->readInto(dest, length);
+}
+
+// Points data at the bytes at the current position without consuming them.
+// Returns how many are available there, at most maxLength.
+inline int LxStream::peekData(const char **data, int maxLength)
+{
+    return device->peekData(data, maxLength);
+}
+
 inline void LxStream::writeZString(const char *str)
 {
-    int x = 0;
-    while(str[x] != 0) {
-        write<char>(str[x]);
-        x++;
-    }
-    write<char>(0);
+    device->writeData(str, strlen(str) + 1);
 }
 
 inline void LxStream::writeData(const char *data, int length)
@@ -445,22 +915,62 @@ inline void LxStream::writeChar(const char c)
 
 inline void LxStream::writeShort(const short s)
 {
-    write<short>(s);
+    if(needsSwap())
+        write<short>(BYTESWAP_16(s));
+    else
+        write<short>(s);
 }
 
 inline void LxStream::writeInt(const int i)
 {
-    write<int>(i);
+    if(needsSwap())
+        write<int>(BYTESWAP_32(i));
+    else
+        write<int>(i);
 }
 
 inline void LxStream::writeFloat(const float f)
 {
-    write<float>(f);
+    if(needsSwap()) {
+        int bf;
+        memcpy(&bf, &f, sizeof(bf));
+        write<int>(BYTESWAP_32(bf));
+    } else {
+        write<float>(f);
+    }
 }
 
 inline void LxStream::writeInt64(const long long i)
 {
-    write<long long>(i);
+    if(needsSwap())
+        write<long long>(BYTESWAP_64(i));
+    else
+        write<long long>(i);
+}
+
+template <typename T> inline int LxStream::readArray(T *dest, int count)
+{
+    int n = device->readInto((char *)dest, count * sizeof(T)) / sizeof(T);
+    if(sizeof(T) > 1 && needsSwap())
+        byteSwapArray((char *)dest, (const char *)dest, n, sizeof(T));
+    return n;
+}
+
+template <typename T> inline void LxStream::writeArray(const T *data, int count)
+{
+    if(sizeof(T) == 1 || !needsSwap()) {
+        device->writeData((const char *)data, count * sizeof(T));
+        return;
+    }
+    char swapped[4096];
+    const int perChunk = sizeof(swapped) / sizeof(T);
+    while(count > 0) {
+        int n = count < perChunk ? count : perChunk;
+        byteSwapArray(swapped, (const char *)data, n, sizeof(T));
+        device->writeData(swapped, n * sizeof(T));
+        data += n;
+        count -= n;
+    }
 }
 
 template<> inline char* LxStream::read<char*>() {
@@ -493,7 +1003,7 @@ inline char *LxCharArrayStream::getData(int length)
     if(position + length > m_size) {
         int n = m_size - position;
         memcpy(d, data+position, n);
-        memset(d+n, 0, length - m_size);
+        memset(d+n, 0, length - n);
         position = m_size;
         error("Error: Reading above end of stream!!");
     } else {
@@ -503,6 +1013,40 @@ inline char *LxCharArrayStream::getData(int length)
     return d;
 }
 
+inline const char *LxCharArrayStream::readData(int length)
+{
+    if(position + length > m_size) {
+        char *d = reserveWindow(length);
+        int n = m_size - position;
+        memcpy(d, data+position, n);
+        memset(d+n, 0, length - n);
+        position = m_size;
+        error("Error: Reading above end of stream!!");
+        return d;
+    }
+    const char *d = data + position;
+    position += length;
+    return d;
+}
+
+inline int LxCharArrayStream::peekData(const char **d, int maxLength)
+{
+    *d = data + position;
+    return m_size - position < maxLength ? m_size - position : maxLength;
+}
+
+inline int LxCharArrayStream::readInto(char *dest, int length)
+{
+    int n = length;
+    if(position + length > m_size) {
+        n = m_size - position;
+        error("Error: Reading above end of stream!!");
+    }
+    memcpy(dest, data+position, n);
+    position += n;
+    return n;
+}
+
 inline void LxCharArrayStream::seek(long long newPos)
 {
     if(newPos >= 0 && newPos <= m_size)
@@ -529,11 +1073,13 @@ inline void LxCharArrayStream::writeData(const char *d, int length)
     }
 }
 
-// TODO: This needs to work with files > 2 GiB
-
 inline LxFileStream::LxFileStream(const char *filename, LxStream::OpenMode mode)
 {
     m_isOpen = false;
+    m_error = false;
+    position = 0;
+    filePosition = 0;
+    m_size = 0;
     char omode[4];
     if(!getOpenMode(mode, omode))
         return;
@@ -542,6 +1088,12 @@ inline LxFileStream::LxFileStream(const char *filename, LxStream::OpenMode mode)
     m_isOpen = file != NULL;
     if(!m_isOpen)
         return;
+
+    if(mode != LxStream::WriteOnly) {
+        LX_FSEEK(file, 0, SEEK_END);
+        m_size = LX_FTELL(file);
+        LX_FSEEK(file, 0, SEEK_SET);
+    }
 }
 
 inline LxFileStream::~LxFileStream()
@@ -552,44 +1104,96 @@ inline LxFileStream::~LxFileStream()
 
 inline void LxFileStream::close()
 {
-    fclose(file);
+    if(!m_isOpen)
+        return;
+    if(fclose(file) != 0)
+        m_error = true;
+    m_isOpen = false;
+}
+
+// Moves the FILE to where the last seek left position.
+inline void LxFileStream::sync()
+{
+    if(filePosition == position)
+        return;
+    if(LX_FSEEK(file, position, SEEK_SET) == 0)
+        filePosition = position;
+    else
+        position = filePosition;
 }
 
 inline char *LxFileStream::getData(int length)
 {
     char * buf = new char[length];
-    fread(buf, length, 1, file);
+    readInto(buf, length);
     return buf;
 }
 
-inline void LxFileStream::seek(long long newPos)
-{
-    fseek(file, newPos, SEEK_SET);
-}
-
-inline long long LxFileStream::pos() const
+// Reads that lie inside the read-ahead block are served from it.
+inline const char *LxFileStream::readData(int length)
 {
-    return ftell(file);
+    if(ahead.available(position) >= length) {
+        const char *d = ahead.at(position);
+        position += length;
+        return d;
+    }
+    sync();
+    char *d = reserveWindow(length);
+    int n = fread(d, 1, length, file);
+    memset(d+n, 0, length - n);
+    position += n;
+    filePosition = position;
+    return d;
 }
 
-inline void LxFileStream::writeData(const char *data, int length)
+inline int LxFileStream::readInto(char *dest, int length)
 {
-    fwrite(data, length, 1, file);
+    if(ahead.available(position) >= length) {
+        memcpy(dest, ahead.at(position), length);
+        position += length;
+        return length;
+    }
+    sync();
+    int n = fread(dest, 1, length, file);
+    position += n;
+    filePosition = position;
+    return n;
+}
+
+// Refills the read-ahead block when it doesn't hold maxLength bytes from
+// the current position, reading at least a whole block.
+inline int LxFileStream::peekData(const char **data, int maxLength)
+{
+    int n = ahead.available(position);
+    if(n < maxLength && position + n < m_size) {
+        sync();
+        ahead.data.resize(maxLength > LxStream::DefaultBlockSize ? maxLength : (int)LxStream::DefaultBlockSize);
+        ahead.data.resize(fread(ahead.data.data(), 1, ahead.data.size(), file));
+        ahead.start = position;
+        filePosition += ahead.data.size();
+        n = ahead.data.size();
+    }
+    *data = n > 0 ? ahead.at(position) : 0;
+    return n < maxLength ? n : maxLength;
 }
 
-inline bool LxFileStream::atEnd() const
+inline void LxFileStream::seek(long long newPos)
 {
-    return size() == pos();
+    if(newPos >= 0)
+        position = newPos;
 }
 
-inline long long LxFileStream::size() const
+inline void LxFileStream::writeData(const char *data, int length)
 {
-    long long p = pos();
-    fseek(file, 0, SEEK_END);
-    long long v = ftell(file);
-    fseek(file, p, SEEK_SET);
-
-    return v;
+    ahead.clear();
+    sync();
+    int n = fwrite(data, 1, length, file);
+    if(n != length)
+        m_error = true;
+    position += n;
+    filePosition = position;
+    if(position > m_size)
+        m_size = position;
 }
 
 inline bool LxFileStream::getOpenMode(LxStream::OpenMode mode, char *newMode)
@@ -615,26 +1219,669 @@ inline bool LxFileStream::getOpenMode(LxStream::OpenMode mode, char *newMode)
     return false;
 }
 
-#ifdef USE_QT
+const long long MAPPED_FILE_MIN_CAPACITY = 64 * 1024;
 
-inline void LxStream::openQFile(QString filename, LxStream::OpenMode mode)
+inline LxMappedFileStream::LxMappedFileStream(const char *filename, LxStream::OpenMode mode)
 {
-    if(device != 0)
-        delete device;
-    device = new LxQFileStream(filename, mode);
-}
-
+    m_isOpen = false;
+    m_error = false;
+    data = 0;
+    position = 0;
+    m_size = 0;
+    capacity = 0;
+
+    if(mode != LxStream::ReadOnly && mode != LxStream::WriteOnly && mode != LxStream::ReadWrite) {
+        error("LxMappedFileStream: Unsupported Mode!");
+        return;
+    }
+    writable = mode != LxStream::ReadOnly;
+
+#ifdef _WIN32
+    mapping = NULL;
+    file = CreateFileA(filename, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                       FILE_SHARE_READ, NULL, mode == LxStream::WriteOnly ? CREATE_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return;
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    m_size = fileSize.QuadPart;
+#else
+    int flags = O_RDONLY;
+    if(mode == LxStream::WriteOnly)
+        flags = O_RDWR | O_CREAT | O_TRUNC;
+    else if(mode == LxStream::ReadWrite)
+        flags = O_RDWR;
+    fd = open(filename, flags, 0666);
+    if(fd < 0)
+        return;
+    struct stat st;
+    fstat(fd, &st);
+    m_size = st.st_size;
+#endif
+    m_isOpen = true;
 
-inline LxStream::LxStream(QString filename, LxStream::OpenMode mode)
-{
-    init();
-    openQFile(filename, mode);
+    long long initialCapacity = m_size;
+    if(writable && initialCapacity < MAPPED_FILE_MIN_CAPACITY)
+        initialCapacity = MAPPED_FILE_MIN_CAPACITY;
+    if(initialCapacity > 0 && !map(initialCapacity)) {
+        error("LxMappedFileStream: Couldn't map file!");
+        close();
+        return;
+    }
+    if(writable) {
+        writePtr = data;
+        writeEnd = data + capacity;
+    }
 }
 
-inline LxStream::LxStream(QByteArray *arr)
+inline LxMappedFileStream::~LxMappedFileStream()
 {
-    init();
-    openByteArray(arr);
+    if(isOpen())
+        close();
+}
+
+inline bool LxMappedFileStream::map(long long newCapacity)
+{
+#ifdef _WIN32
+    mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                 (DWORD)(newCapacity >> 32), (DWORD)newCapacity, NULL);
+    if(mapping == NULL)
+        return false;
+    data = (char *)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)newCapacity);
+    if(data == NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return false;
+    }
+#else
+    if(writable && ftruncate(fd, newCapacity) != 0)
+        return false;
+    void *p = mmap(0, newCapacity, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        data = 0;
+        return false;
+    }
+    data = (char *)p;
+#endif
+    capacity = newCapacity;
+    return true;
+}
+
+inline void LxMappedFileStream::unmap()
+{
+    if(data == 0)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    mapping = NULL;
+#else
+    munmap(data, capacity);
+#endif
+    data = 0;
+    capacity = 0;
+}
+
+// Makes sure that at least length bytes are mapped, keeping the cursor.
+inline bool LxMappedFileStream::reserve(long long length)
+{
+    if(length <= capacity)
+        return true;
+    long long p = pos();
+    long long s = size();
+    long long newCapacity = capacity > 0 ? capacity : MAPPED_FILE_MIN_CAPACITY;
+    while(newCapacity < length)
+        newCapacity *= 2;
+    unmap();
+    if(!map(newCapacity)) {
+        error("LxMappedFileStream: Couldn't grow mapping!");
+        m_error = true;
+        writePtr = 0;
+        writeEnd = 0;
+        return false;
+    }
+    m_size = s;
+    writePtr = data + p;
+    writeEnd = data + capacity;
+    return true;
+}
+
+inline void LxMappedFileStream::close()
+{
+    if(!m_isOpen)
+        return;
+    long long finalSize = size();
+    unmap();
+    writePtr = 0;
+    writeEnd = 0;
+#ifdef _WIN32
+    if(writable) {
+        LARGE_INTEGER end;
+        end.QuadPart = finalSize;
+        if(!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+            m_error = true;
+    }
+    CloseHandle(file);
+#else
+    if(writable && ftruncate(fd, finalSize) != 0) {
+        error("LxMappedFileStream: Couldn't truncate file!");
+        m_error = true;
+    }
+    ::close(fd);
+#endif
+    m_isOpen = false;
+}
+
+inline long long LxMappedFileStream::pos() const
+{
+    return writable ? writePtr - data : position;
+}
+
+inline long long LxMappedFileStream::size() const
+{
+    long long p = pos();
+    return p > m_size ? p : m_size;
+}
+
+inline char *LxMappedFileStream::getData(int length)
+{
+    char *d = new char[length];
+    memcpy(d, readData(length), length);
+    return d;
+}
+
+inline const char *LxMappedFileStream::readData(int length)
+{
+    long long p = pos();
+    long long s = size();
+    long long next = p + length;
+    const char *d = data + p;
+    if(next > s) {
+        char *w = reserveWindow(length);
+        int n = s - p;
+        memcpy(w, data + p, n);
+        memset(w+n, 0, length - n);
+        next = s;
+        d = w;
+        error("Error: Reading above end of stream!!");
+    }
+    if(writable)
+        writePtr = data + next;
+    else
+        position = next;
+    return d;
+}
+
+inline int LxMappedFileStream::peekData(const char **d, int maxLength)
+{
+    long long p = pos();
+    long long available = size() - p;
+    *d = data + p;
+    return available < maxLength ? available : maxLength;
+}
+
+inline int LxMappedFileStream::readInto(char *dest, int length)
+{
+    long long p = pos();
+    long long s = size();
+    int n = p + length > s ? s - p : length;
+    memcpy(dest, data + p, n);
+    if(writable)
+        writePtr = data + p + n;
+    else
+        position = p + n;
+    return n;
+}
+
+inline void LxMappedFileStream::seek(long long newPos)
+{
+    if(newPos < 0) {
+        error("Error: Seeking below beginning of stream!!");
+        newPos = 0;
+    }
+    if(writable) {
+        m_size = size();
+        if(reserve(newPos))
+            writePtr = data + newPos;
+    } else {
+        if(newPos > m_size) {
+            error("Error: Seeking above end of stream!!");
+            newPos = m_size;
+        }
+        position = newPos;
+    }
+}
+
+inline void LxMappedFileStream::writeData(const char *d, int length)
+{
+    if(!writable) {
+        error("LxMappedFileStream: Stream is read only!");
+        m_error = true;
+        return;
+    }
+    if(!reserve(pos() + length))
+        return;
+    memcpy(writePtr, d, length);
+    writePtr += length;
+}
+
+inline LxMemoryStream::LxMemoryStream(long long reserveSize)
+{
+    m_size = 0;
+    reserve(reserveSize);
+}
+
+// Makes room for at least length bytes without changing the size.
+inline void LxMemoryStream::reserve(long long length)
+{
+    if(length <= (long long)buffer.size())
+        return;
+    long long p = pos();
+    if(p > m_size)
+        m_size = p;
+    buffer.resize(length);
+    writePtr = buffer.data() + p;
+    writeEnd = buffer.data() + buffer.size();
+}
+
+inline void LxMemoryStream::grow(long long length)
+{
+    if(length <= (long long)buffer.size())
+        return;
+    long long newSize = buffer.size() > 0 ? (long long)buffer.size() : (long long)LxStream::DefaultBlockSize;
+    while(newSize < length)
+        newSize *= 2;
+    reserve(newSize);
+}
+
+// Hands the contents over to out and leaves the stream empty.
+inline void LxMemoryStream::take(std::vector<char> &out)
+{
+    buffer.resize(size());
+    out.clear();
+    out.swap(buffer);
+    m_size = 0;
+    writePtr = 0;
+    writeEnd = 0;
+}
+
+inline long long LxMemoryStream::size() const
+{
+    long long p = pos();
+    return p > m_size ? p : m_size;
+}
+
+inline char *LxMemoryStream::getData(int length)
+{
+    char *d = new char[length];
+    memcpy(d, readData(length), length);
+    return d;
+}
+
+inline const char *LxMemoryStream::readData(int length)
+{
+    if(pos() + length <= size()) {
+        const char *d = writePtr;
+        writePtr += length;
+        return d;
+    }
+    char *d = reserveWindow(length);
+    int n = readInto(d, length);
+    memset(d+n, 0, length - n);
+    error("Error: Reading above end of stream!!");
+    return d;
+}
+
+inline int LxMemoryStream::peekData(const char **data, int maxLength)
+{
+    long long available = size() - pos();
+    *data = writePtr;
+    return available < maxLength ? available : maxLength;
+}
+
+inline int LxMemoryStream::readInto(char *dest, int length)
+{
+    long long p = pos();
+    long long s = size();
+    int n = p + length > s ? s - p : length;
+    if(n <= 0)
+        return 0;
+    memcpy(dest, writePtr, n);
+    writePtr += n;
+    return n;
+}
+
+inline void LxMemoryStream::seek(long long newPos)
+{
+    if(newPos < 0) {
+        error("Error: Seeking below beginning of stream!!");
+        newPos = 0;
+    }
+    long long p = pos();
+    if(p > m_size)
+        m_size = p;
+    grow(newPos);
+    writePtr = buffer.data() + newPos;
+}
+
+inline void LxMemoryStream::writeData(const char *data, int length)
+{
+    grow(pos() + length);
+    memcpy(writePtr, data, length);
+    writePtr += length;
+}
+
+inline LxAtomicFileStream::LxAtomicFileStream(const std::string &filename, long long reserveSize)
+    : LxMemoryStream(reserveSize)
+{
+    this->filename = filename;
+    m_isOpen = true;
+    m_error = false;
+}
+
+inline LxAtomicFileStream::~LxAtomicFileStream()
+{
+    if(isOpen())
+        close();
+}
+
+inline void LxAtomicFileStream::close()
+{
+    if(!m_isOpen)
+        return;
+    m_isOpen = false;
+    if(!commit()) {
+        error(("LxAtomicFileStream: Couldn't write " + filename).c_str());
+        m_error = true;
+    }
+}
+
+inline bool LxAtomicFileStream::commit()
+{
+    long long s = size();
+#ifdef USE_QT
+    QSaveFile file(QFile::decodeName(filename.c_str()));
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+    // An uncommitted QSaveFile removes its temporary file
+    if(file.write(constData(), s) != s)
+        return false;
+    return file.commit();
+#else
+    return writeFileAtomically(filename, constData(), s);
+#endif
+}
+
+inline LxBufferedStream::LxBufferedStream(LxStreamDevice *d, int blockSize)
+{
+    this->device = d;
+    this->blockSize = blockSize;
+    this->buffer = new char[blockSize];
+    writePtr = buffer;
+    writeEnd = buffer + blockSize;
+}
+
+inline LxBufferedStream::~LxBufferedStream()
+{
+    flush();
+    delete device;
+    delete[] buffer;
+}
+
+inline void LxBufferedStream::flush()
+{
+    if(writePtr != buffer) {
+        device->writeData(buffer, writePtr - buffer);
+        writePtr = buffer;
+    }
+}
+
+inline void LxBufferedStream::close()
+{
+    flush();
+    device->close();
+}
+
+inline char *LxBufferedStream::getData(int length)
+{
+    flush();
+    return device->getData(length);
+}
+
+inline const char *LxBufferedStream::readData(int length)
+{
+    flush();
+    return device->readData(length);
+}
+
+inline int LxBufferedStream::readInto(char *dest, int length)
+{
+    flush();
+    return device->readInto(dest, length);
+}
+
+inline int LxBufferedStream::peekData(const char **data, int maxLength)
+{
+    flush();
+    return device->peekData(data, maxLength);
+}
+
+inline void LxBufferedStream::seek(long long newPos)
+{
+    flush();
+    device->seek(newPos);
+}
+
+// The const queries account for the pending bytes instead of flushing them.
+
+inline long long LxBufferedStream::pos() const
+{
+    return device->pos() + (writePtr - buffer);
+}
+
+inline void LxBufferedStream::writeData(const char *data, int length)
+{
+    if(writeEnd - writePtr < length) {
+        flush();
+        if(length >= blockSize) {
+            device->writeData(data, length);
+            return;
+        }
+    }
+    memcpy(writePtr, data, length);
+    writePtr += length;
+}
+
+inline bool LxBufferedStream::atEnd() const
+{
+    return pos() == size();
+}
+
+inline long long LxBufferedStream::size() const
+{
+    long long s = device->size();
+    long long p = pos();
+    return p > s ? p : s;
+}
+
+inline LxAsyncWriteStream::LxAsyncWriteStream(LxStreamDevice *d, int blockSize)
+    : m_error(false)
+{
+    this->device = d;
+    this->blockSize = blockSize;
+    front = new char[blockSize];
+    back = new char[blockSize];
+    base = device->pos();
+    m_size = device->size();
+    pendingSize = 0;
+    stopping = false;
+    writePtr = front;
+    writeEnd = front + blockSize;
+    thread = std::thread(&LxAsyncWriteStream::run, this);
+}
+
+inline LxAsyncWriteStream::~LxAsyncWriteStream()
+{
+    if(thread.joinable())
+        close();
+    delete device;
+    delete[] front;
+    delete[] back;
+}
+
+inline void LxAsyncWriteStream::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        wake.wait(lock, [this] { return pendingSize > 0 || stopping; });
+        if(pendingSize == 0)
+            return;
+
+        lock.unlock();
+        device->writeData(back, pendingSize);
+        if(device->hasError())
+            m_error = true;
+        lock.lock();
+
+        pendingSize = 0;
+        idle.notify_all();
+    }
+}
+
+// Hands the filled front block to the writer thread.
+inline void LxAsyncWriteStream::submit()
+{
+    int fill = writePtr - front;
+    if(fill == 0)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pendingSize == 0; });
+        std::swap(front, back);
+        pendingSize = fill;
+    }
+    wake.notify_one();
+
+    base += fill;
+    if(base > m_size)
+        m_size = base;
+    writePtr = front;
+    writeEnd = front + blockSize;
+}
+
+// Waits until everything written so far has reached the device.
+inline void LxAsyncWriteStream::drain()
+{
+    submit();
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return pendingSize == 0; });
+}
+
+inline void LxAsyncWriteStream::close()
+{
+    if(thread.joinable()) {
+        drain();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+    device->close();
+    if(device->hasError())
+        m_error = true;
+}
+
+inline char *LxAsyncWriteStream::getData(int length)
+{
+    drain();
+    char *d = device->getData(length);
+    base = device->pos();
+    return d;
+}
+
+inline const char *LxAsyncWriteStream::readData(int length)
+{
+    drain();
+    const char *d = device->readData(length);
+    base = device->pos();
+    return d;
+}
+
+inline int LxAsyncWriteStream::readInto(char *dest, int length)
+{
+    drain();
+    int n = device->readInto(dest, length);
+    base = device->pos();
+    return n;
+}
+
+inline int LxAsyncWriteStream::peekData(const char **data, int maxLength)
+{
+    drain();
+    return device->peekData(data, maxLength);
+}
+
+inline void LxAsyncWriteStream::seek(long long newPos)
+{
+    drain();
+    device->seek(newPos);
+    base = device->pos();
+}
+
+inline void LxAsyncWriteStream::writeData(const char *data, int length)
+{
+    while(length > 0) {
+        int n = writeEnd - writePtr;
+        if(n > length)
+            n = length;
+        memcpy(writePtr, data, n);
+        writePtr += n;
+        data += n;
+        length -= n;
+        if(writePtr == writeEnd)
+            submit();
+    }
+}
+
+inline long long LxAsyncWriteStream::size() const
+{
+    long long p = pos();
+    return p > m_size ? p : m_size;
+}
+
+#ifdef USE_QT
+
+inline void LxStream::openQFile(QString filename, LxStream::OpenMode mode)
+{
+    if(device != 0)
+        delete device;
+    device = new LxQFileStream(filename, mode);
+}
+
+
+inline void LxStream::openMappedFile(QString filename, LxStream::OpenMode mode)
+{
+    openMappedFile(QFile::encodeName(filename).constData(), mode);
+}
+
+inline void LxStream::openAtomicFile(QString filename, long long reserveSize)
+{
+    openAtomicFile(QFile::encodeName(filename).constData(), reserveSize);
+}
+
+inline LxStream::LxStream(QString filename, LxStream::OpenMode mode)
+{
+    init();
+    openQFile(filename, mode);
+}
+
+inline LxStream::LxStream(QByteArray *arr)
+{
+    init();
+    openByteArray(arr);
 }
 
 inline void LxStream::openByteArray(QByteArray *ba)
@@ -651,9 +1898,8 @@ inline QByteArray LxStream::readAll()
 
 inline QByteArray LxStream::readByteArray(int length)
 {
-    char * d = device->getData(length);
-    QByteArray ret(d, length);
-    delete d;
+    QByteArray ret(length, Qt::Uninitialized);
+    ret.resize(device->readInto(ret.data(), length));
     return ret;
 }
 
@@ -662,39 +1908,79 @@ inline void LxStream::writeByteArray(QByteArray data)
     device->writeData(data.constData(), data.size());
 }
 
+const int STRING_WINDOW_SIZE = 4096;
+
 inline QString LxStream::readQString()
 {
     QString str;
-    char c = -1;
-    while(!atEnd()) {
-        c = read<char>();
-        if(c == 0)
+    while(true) {
+        const char *d;
+        int n = device->peekData(&d, STRING_WINDOW_SIZE);
+        if(n <= 0)
+            return str;
+        const char *end = (const char *)memchr(d, 0, n);
+        int length = end ? end - d : n;
+        str.append(QLatin1String(d, length));
+        skip(end ? length + 1 : length);
+        if(end)
             return str;
-        str.append(c);
     }
-    return str;
 }
 
-inline void LxStream::writeQString(const QString s)
+// Writes the string as Latin-1 without a terminator. Characters outside of
+// Latin-1 become '?', like QString::toLatin1() does.
+inline void LxStream::writeQString(const QString &s)
 {
-    writeByteArray(s.toLatin1());
+    const QChar *c = s.constData();
+    int n = s.length();
+    char buf[256];
+    while(n > 0) {
+        char *out = buf;
+        int length = n < (int)sizeof(buf) ? n : sizeof(buf);
+        if(device->writeEnd - device->writePtr >= n) {
+            out = device->writePtr;
+            length = n;
+        }
+        for(int i = 0; i < length; i++) {
+            ushort u = c[i].unicode();
+            out[i] = u > 0xff ? '?' : char(u);
+        }
+        if(out == buf)
+            device->writeData(buf, length);
+        else
+            device->writePtr += length;
+        c += length;
+        n -= length;
+    }
 }
 
+// Reads up to and including the next '\n' or 0.
 inline QString LxStream::readLine()
 {
     QString str;
-    char c = -1;
-    do {
-        c = read<char>();
-        str.append(c);
-    } while(c != 0 && c != '\n' && !atEnd());
-    return str;
+    while(true) {
+        const char *d;
+        int n = device->peekData(&d, STRING_WINDOW_SIZE);
+        if(n <= 0)
+            return str;
+        const char *end = (const char *)memchr(d, 0, n);
+        const char *newline = (const char *)memchr(d, '\n', end ? end - d : n);
+        if(newline)
+            end = newline;
+        int length = end ? end - d + 1 : n;
+        str.append(QLatin1String(d, length));
+        skip(length);
+        if(end)
+            return str;
+    }
 }
 
 inline LxQFileStream::LxQFileStream(QString filename, LxStream::OpenMode mode)
 {
+    m_error = false;
     file.setFileName(filename);
     file.open((QIODevice::OpenMode) mode);
+    position = file.pos();
 }
 
 inline LxQFileStream::~LxQFileStream()
@@ -705,6 +1991,8 @@ inline LxQFileStream::~LxQFileStream()
 
 inline void LxQFileStream::close()
 {
+    if(file.isOpen() && !file.flush())
+        m_error = true;
     file.close();
 }
 
@@ -713,31 +2001,88 @@ inline bool LxQFileStream::isOpen() const
     return file.isOpen();
 }
 
+inline void LxQFileStream::sync()
+{
+    if(file.pos() != position && !file.seek(position))
+        position = file.pos();
+}
+
 inline char *LxQFileStream::getData(int length)
 {
     char *d = new char[length];
-    file.read(d, length);
+    readInto(d, length);
+    return d;
+}
+
+inline const char *LxQFileStream::readData(int length)
+{
+    if(ahead.available(position) >= length) {
+        const char *d = ahead.at(position);
+        position += length;
+        return d;
+    }
+    sync();
+    char *d = reserveWindow(length);
+    int n = file.read(d, length);
+    if(n < 0)
+        n = 0;
+    memset(d+n, 0, length - n);
+    position = file.pos();
     return d;
 }
 
+inline int LxQFileStream::readInto(char *dest, int length)
+{
+    if(ahead.available(position) >= length) {
+        memcpy(dest, ahead.at(position), length);
+        position += length;
+        return length;
+    }
+    sync();
+    int n = file.read(dest, length);
+    position = file.pos();
+    return n < 0 ? 0 : n;
+}
+
+// See LxFileStream::peekData()
+inline int LxQFileStream::peekData(const char **data, int maxLength)
+{
+    int n = ahead.available(position);
+    if(n < maxLength && position + n < file.size()) {
+        sync();
+        ahead.data.resize(maxLength > LxStream::DefaultBlockSize ? maxLength : (int)LxStream::DefaultBlockSize);
+        long long read = file.read(ahead.data.data(), ahead.data.size());
+        ahead.data.resize(read < 0 ? 0 : read);
+        ahead.start = position;
+        n = ahead.data.size();
+    }
+    *data = n > 0 ? ahead.at(position) : 0;
+    return n < maxLength ? n : maxLength;
+}
+
 inline void LxQFileStream::seek(long long newPos)
 {
-    file.seek(newPos);
+    if(newPos >= 0)
+        position = newPos;
 }
 
 inline long long LxQFileStream::pos() const
 {
-    return file.pos();
+    return position;
 }
 
 inline void LxQFileStream::writeData(const char *data, int length)
 {
-    file.write(data, length);
+    ahead.clear();
+    sync();
+    if(file.write(data, length) != length)
+        m_error = true;
+    position = file.pos();
 }
 
 inline bool LxQFileStream::atEnd() const
 {
-    return file.atEnd();
+    return position >= file.size();
 }
 
 inline long long LxQFileStream::size() const
@@ -765,6 +2110,35 @@ inline char *LxQByteArrayStream::getData(int length)
     return d;
 }
 
+inline const char *LxQByteArrayStream::readData(int length)
+{
+    long long p = buf.pos();
+    if(p + length > buf.size()) {
+        char *d = reserveWindow(length);
+        int n = buf.read(d, length);
+        if(n < 0)
+            n = 0;
+        memset(d+n, 0, length - n);
+        return d;
+    }
+    buf.seek(p + length);
+    return buf.data().constData() + p;
+}
+
+inline int LxQByteArrayStream::peekData(const char **data, int maxLength)
+{
+    long long p = buf.pos();
+    long long available = buf.size() - p;
+    *data = buf.data().constData() + p;
+    return available < maxLength ? available : maxLength;
+}
+
+inline int LxQByteArrayStream::readInto(char *dest, int length)
+{
+    int n = buf.read(dest, length);
+    return n < 0 ? 0 : n;
+}
+
 inline void LxQByteArrayStream::seek(long long newPos)
 {
     buf.seek(newPos);
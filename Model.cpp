@@ -1,60 +1,165 @@
 #include "Model.h"
-#include <QtXml/QDomDocument>
+#include <QXmlStreamReader>
 #include <QFile>
 #include <QDebug>
 #include <QtMath>
+#include <QVector>
+#include <QtConcurrent>
+#include <algorithm>
+#include <limits>
 #include "Utils.h"
 #include "LxStream.h"
+#include "LxBatchWriter.h"
+#include "OgreBinary.h"
+#include "Gltf.h"
+#include "ParallelXml.h"
+#include "XmlScanner.h"
+#include "AssetCache.h"
 
 const float SCALE_FACTOR = 1.0;
+const char MESH_NAME[] = "Dragon";
 
 Model::Model() {
 
 }
 
-Model Model::fromFile(QString filename) {
+// Loads the parsed model from its cache if that is up to date, otherwise
+// parses the file and caches the result.
+Model Model::fromFile(QString filename, bool parallel) {
+    AssetCache cache(filename, "model");
+    LxStream stream;
     Model m;
-    QDomDocument doc = Utils::readXMLFile(filename);
+    if(cache.load(stream)) {
+        m.readCache(stream);
+        return m;
+    }
+
+    m = parseFile(filename, parallel);
+
+    // A failed parse leaves the model empty and is tried again next time
+    if(m.geometry.positionCount() == 0) {
+        return m;
+    }
+
+    QByteArray payload;
+    LxStream out(&payload);
+    // The cache is written value by value, collect it in blocks
+    out.setBuffered();
+    m.writeCache(out);
+    out.close();
+    cache.store(payload);
+
+    return m;
+}
+
+// Streams the .MESH.xml in a single pass instead of building a DOM. Only the
+// first <sharedgeometry>, <submeshes> and <boneassignments> of <mesh> are read.
+// In parallel mode large vertex buffers, face lists and bone assignments are
+// parsed on worker threads; the result is the same as the serial one.
+Model Model::parseFile(QString filename, bool parallel) {
+    if(filename.endsWith(".mesh", Qt::CaseInsensitive)) {
+        return fromBinaryFile(filename);
+    }
+    if(filename.endsWith(".glb", Qt::CaseInsensitive)) {
+        return fromGltfFile(filename);
+    }
+
+    ParallelXml::Document doc;
+    if(parallel && ParallelXml::load(filename, {"vertexbuffer", "faces", "boneassignments"}, doc)) {
+        Model m;
+        if(parseMesh(doc.remainder, m, &doc)) {
+            return m;
+        }
+        // Anything unusual is left to the serial parser
+    }
+
+    Model m;
+    QFile file(filename);
 
-    QDomElement mesh = doc.firstChildElement("mesh");
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Couldn't open file.";
+        return m;
+    }
 
-    m.geometry = getGeometry(mesh);
-    m.faces = getFaces(mesh);
+    // A document that doesn't parse yields an empty model, as it did with the DOM
+    QString error;
+    if(!parseMesh(Utils::mapFile(file), m, 0, &error)) {
+        qDebug() << "Couldn't parse" << filename << ":" << error;
+        return Model();
+    }
 
     return m;
 }
 
+// Scans the document straight from its bytes with XmlScanner and only falls
+// back to QXmlStreamReader if it contains something the scanner doesn't
+// handle. Returns false if a section cut out of doc couldn't be parsed or if
+// the document is broken, which error then describes.
+bool Model::parseMesh(const QByteArray &data, Model &m, const ParallelXml::Document *doc, QString *error) {
+    XmlScanner scanner(data.constData(), data.length());
+    bool ok = readMesh(scanner, m, doc);
+    if(!scanner.hasError()) {
+        return ok;
+    }
+
+    m = Model();
+    QXmlStreamReader xml(data);
+    ok = readMesh(xml, m, doc);
+    if(xml.hasError()) {
+        if(error) {
+            *error = xml.errorString();
+        }
+        return false;
+    }
+    return ok;
+}
+
+// Returns false if a section cut out of doc couldn't be parsed.
+template <typename Reader>
+bool Model::readMesh(Reader &xml, Model &m, const ParallelXml::Document *doc) {
+    bool ok = true;
+    if(xml.readNextStartElement() && xml.name() == QLatin1String("mesh")) {
+        bool gotGeometry = false, gotSubmeshes = false, gotWeights = false;
+        while(ok && xml.readNextStartElement()) {
+            auto name = xml.name();
+            if(!gotGeometry && name == QLatin1String("sharedgeometry")) {
+                ok = readSharedGeometry(xml, m.geometry, doc);
+                gotGeometry = true;
+            } else if(!gotSubmeshes && name == QLatin1String("submeshes")) {
+                ok = readSubmeshes(xml, m.faces, doc);
+                gotSubmeshes = true;
+            } else if(!gotWeights && name == QLatin1String("boneassignments")) {
+                ok = readBoneAssignments(xml, m.geometry.vertexWeights, doc);
+                gotWeights = true;
+            } else {
+                xml.skipCurrentElement();
+            }
+        }
+    }
+    return ok;
+}
+
 Model Model::dummy() {
     Model m;
-    m.geometry.UVs = {
-        {0, 0},
-        {0, 1},
-        {1, 0},
-    };
-
-    WeightEntry we;
-    we.weights.append({0, 1.f});
-//    we.weights.append({2, 0.5f});
-
-    m.geometry.vertexWeights = {
-        we, we, we
-    };
-
-    m.geometry.vertexNormals = {
-        {0, 1.f, 0},
-        {0, 1.f, 0},
-        {0, 1.f, 0},
-    };
-
-    m.geometry.vertexPositions = {
-        {0, 0, 0},
-        {0, 0, 10.f},
-        {7.5f, 0, 0},
-    };
-
-    m.faces = {
-        {0, 0, 0}
-    };
+    m.geometry.appendUV(0, 0);
+    m.geometry.appendUV(0, 1);
+    m.geometry.appendUV(1, 0);
+
+    m.geometry.vertexWeights.build({
+        {0, {0, 1.f}},
+        {1, {0, 1.f}},
+        {2, {0, 1.f}},
+    });
+
+    m.geometry.appendNormal(0, 1.f, 0);
+    m.geometry.appendNormal(0, 1.f, 0);
+    m.geometry.appendNormal(0, 1.f, 0);
+
+    m.geometry.appendPosition(0, 0, 0);
+    m.geometry.appendPosition(0, 0, 10.f);
+    m.geometry.appendPosition(7.5f, 0, 0);
+
+    m.faces.append(0, 0, 0);
 
     float anskRotAngle = 2.76351f;
     QVector3D anskRotAxis = {-0.500949f, -0.843208f, -0.195062f};
@@ -138,74 +243,210 @@ void Model::writeShaderParams(LxStream &stream) {
     writeParamString(stream, "specTexture", "");
 }
 
-void Model::writeMesh(LxStream &stream, QMap<int, int> boneConv) {
-    stream.writeInt(1);
-    long long posTotalSize = stream.pos();
-    stream.writeInt(0); // placeholder
-
-    // Data
-    Utils::writeString(stream, "Dragon");
-    stream.writeInt(0);
-    stream.writeInt(0);
+// Pool entry of vertex v. Indices past the end of a shorter pool are kept.
+static int poolIndex(const QVector<int> &map, int v) {
+    return (unsigned int)v < (unsigned int)map.size() ? map[v] : v;
+}
 
-    stream.writeInt(faces.length());
-    stream.writeInt(geometry.vertexPositions.length());
-    stream.writeInt(geometry.vertexNormals.length());
-    stream.writeInt(geometry.UVs.length());
-    stream.writeInt(geometry.vertexWeights.length()); // NumWeights
-    stream.writeInt(0);
+// Fills in the vertex, normal, UV and weight index of one face corner.
+static int *writeCorner(int *c, const MeshPools &pools, int v) {
+    c[0] = poolIndex(pools.positionMap, v); // vertex
+    c[1] = poolIndex(pools.normalMap, v); // normal
+    c[2] = poolIndex(pools.uvMap, v); // UVs
+    c[3] = 0;
+    c[4] = poolIndex(pools.weightMap, v); // Weights
+    return c + 5;
+}
 
-    for(Triangle face : faces) {
-        stream.writeInt(face.v1); // vertex
-        stream.writeInt(face.v1); // normal
-        stream.writeInt(face.v1); // UVs
-        stream.writeInt(0);
-        stream.writeInt(face.v1); // Weights
+static void interleave(float *out, const QVector<int> &pool,
+                       const QVector<float> &x, const QVector<float> &y, const QVector<float> &z) {
+    const float *px = x.constData(), *py = y.constData(), *pz = z.constData();
+    for(int i : pool) {
+        *out++ = px[i] * SCALE_FACTOR;
+        *out++ = py[i] * SCALE_FACTOR;
+        *out++ = pz[i] * SCALE_FACTOR;
+    }
+}
 
-        stream.writeInt(face.v2); // vertex
-        stream.writeInt(face.v2); // normal
-        stream.writeInt(face.v2); // UVs
-        stream.writeInt(0);
-        stream.writeInt(face.v2); // Weights
+static inline uint floatBits(float f) {
+    uint u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
 
-        stream.writeInt(face.v3); // vertex
-        stream.writeInt(face.v3); // normal
-        stream.writeInt(face.v3); // UVs
-        stream.writeInt(0);
-        stream.writeInt(face.v3); // Weights
+static inline uint mixHash(uint h, uint v) {
+    h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+}
 
-        stream.writeInt(0);
-        stream.writeInt(0);
+// Maps every element to the first element equal to it and lists those first
+// elements in unique. The table uses open addressing over pool indices, so
+// nothing is allocated per element. Values are compared bit for bit.
+template <typename Hash, typename Equal>
+static QVector<int> deduplicate(int count, Hash hash, Equal equal, QVector<int> &unique) {
+    int size = 16;
+    while(size < count * 2) {
+        size *= 2;
+    }
+    QVector<int> table(size, -1);
+    QVector<int> map(count);
+    unique.clear();
+    unique.reserve(count);
+
+    for(int i = 0; i < count; i++) {
+        uint slot = hash(i) & (size - 1);
+        while(true) {
+            int entry = table[slot];
+            if(entry < 0) {
+                table[slot] = unique.size();
+                map[i] = unique.size();
+                unique.append(i);
+                break;
+            }
+            if(equal(unique[entry], i)) {
+                map[i] = entry;
+                break;
+            }
+            slot = (slot + 1) & (size - 1);
+        }
     }
+    return map;
+}
+
+// Hashes and compares entries of three component arrays
+struct VectorPool {
+    const QVector<float> &x, &y, &z;
 
-    for(QVector3D vertex : geometry.vertexPositions) {
-        stream.writeFloat(vertex.x() * SCALE_FACTOR);
-        stream.writeFloat(vertex.y() * SCALE_FACTOR);
-        stream.writeFloat(vertex.z() * SCALE_FACTOR);
+    uint operator()(int i) const {
+        return mixHash(mixHash(floatBits(x[i]), floatBits(y[i])), floatBits(z[i]));
     }
 
-    for(QVector3D normal : geometry.vertexNormals) {
-        stream.writeFloat(normal.x() * SCALE_FACTOR);
-        stream.writeFloat(normal.y() * SCALE_FACTOR);
-        stream.writeFloat(normal.z() * SCALE_FACTOR);
+    bool operator()(int a, int b) const {
+        return floatBits(x[a]) == floatBits(x[b]) && floatBits(y[a]) == floatBits(y[b])
+                && floatBits(z[a]) == floatBits(z[b]);
     }
+};
+
+// Ogre splits vertices at UV and normal seams, so positions and weights
+// repeat a lot. Each pool is deduplicated on its own.
+MeshPools Model::buildPools() const {
+    MeshPools pools;
+    const Geometry &g = geometry;
+
+    VectorPool positions = {g.positionX, g.positionY, g.positionZ};
+    pools.positionMap = deduplicate(g.positionCount(), positions, positions, pools.positions);
+    VectorPool normals = {g.normalX, g.normalY, g.normalZ};
+    pools.normalMap = deduplicate(g.normalCount(), normals, normals, pools.normals);
+
+    pools.uvMap = deduplicate(g.uvCount(), [&g](int i) {
+        return mixHash(floatBits(g.texU[i]), floatBits(g.texV[i]));
+    }, [&g](int a, int b) {
+        return floatBits(g.texU[a]) == floatBits(g.texU[b]) && floatBits(g.texV[a]) == floatBits(g.texV[b]);
+    }, pools.uvs);
+
+    const SkinWeights &skin = g.vertexWeights;
+    pools.weightMap = deduplicate(skin.vertexCount(), [&skin](int i) {
+        uint h = skin.count(i);
+        for(int j = skin.offsets[i]; j < skin.offsets[i + 1]; j++) {
+            h = mixHash(mixHash(h, skin.bones[j]), floatBits(skin.weights[j]));
+        }
+        return h;
+    }, [&skin](int a, int b) {
+        int n = skin.count(a);
+        if(n != skin.count(b)) {
+            return false;
+        }
+        int ja = skin.offsets[a], jb = skin.offsets[b];
+        for(int k = 0; k < n; k++) {
+            if(skin.bones[ja + k] != skin.bones[jb + k]
+                    || floatBits(skin.weights[ja + k]) != floatBits(skin.weights[jb + k])) {
+                return false;
+            }
+        }
+        return true;
+    }, pools.weights);
 
-    for(Vector2 texCoord : geometry.UVs) {
-        stream.writeFloat(texCoord.x * SCALE_FACTOR);
-        stream.writeFloat((1-texCoord.y) * SCALE_FACTOR);
+    return pools;
+}
+
+// Size of the mesh data that follows the size field, computed from the
+// counts so that the mesh can be written in a single sequential pass.
+long long Model::meshSize(const QString &name, const MeshPools &pools) const {
+    const SkinWeights &skin = geometry.vertexWeights;
+    long long size = Utils::stringSize(name);
+    size += 8 * 4; // Two unknown ints and six counts
+    size += (long long)faces.length() * 17 * 4;
+    size += (long long)pools.positions.size() * 3 * 4;
+    size += (long long)pools.normals.size() * 3 * 4;
+    size += (long long)pools.uvs.size() * 2 * 4;
+    for(int i : pools.weights) {
+        size += 4 + (long long)skin.count(i) * 8;
     }
+    return size;
+}
 
-    for(WeightEntry we : geometry.vertexWeights) {
-        stream.writeInt(we.weights.length());
-        for(Weight weight : we.weights) {
-            stream.writeInt(boneConv[weight.boneID]);
-            stream.writeFloat(weight.weight);
+// The mesh block stores its size in 32 bits, exportMDL() checks that it fits.
+void Model::writeMesh(LxStream &stream, QMap<int, int> boneConv, const MeshPools &pools) {
+    const QString name = MESH_NAME;
+
+    long long size = meshSize(name, pools);
+    Q_ASSERT(size <= std::numeric_limits<int>::max());
+
+    stream.writeInt(1);
+    stream.writeInt((int)size);
+
+    // Data
+    Utils::writeString(stream, name);
+    stream.writeInt(0);
+    stream.writeInt(0);
+
+    stream.writeInt(faces.length());
+    stream.writeInt(pools.positions.size());
+    stream.writeInt(pools.normals.size());
+    stream.writeInt(pools.uvs.size());
+    stream.writeInt(pools.weights.size()); // NumWeights
+    stream.writeInt(0);
+
+    QVector<int> corners(faces.length() * 17);
+    int *c = corners.data();
+    for(int i = 0; i < faces.size(); i += 3) {
+        c = writeCorner(c, pools, faces.index(i));
+        c = writeCorner(c, pools, faces.index(i + 1));
+        c = writeCorner(c, pools, faces.index(i + 2));
+        *c++ = 0;
+        *c++ = 0;
+    }
+    stream.writeArray(corners.constData(), corners.size());
+
+    // The file interleaves the components, so they are gathered from the
+    // separate arrays in one pass each.
+    QVector<float> floats;
+
+    floats.resize(pools.positions.size() * 3);
+    interleave(floats.data(), pools.positions, geometry.positionX, geometry.positionY, geometry.positionZ);
+    stream.writeArray(floats.constData(), floats.size());
+
+    floats.resize(pools.normals.size() * 3);
+    interleave(floats.data(), pools.normals, geometry.normalX, geometry.normalY, geometry.normalZ);
+    stream.writeArray(floats.constData(), floats.size());
+
+    floats.resize(pools.uvs.size() * 2);
+    float *f = floats.data();
+    const float *u = geometry.texU.constData(), *v = geometry.texV.constData();
+    for(int i : pools.uvs) {
+        *f++ = u[i] * SCALE_FACTOR;
+        *f++ = (1 - v[i]) * SCALE_FACTOR;
+    }
+    stream.writeArray(floats.constData(), floats.size());
+
+    const SkinWeights &skin = geometry.vertexWeights;
+    for(int i : pools.weights) {
+        stream.writeInt(skin.count(i));
+        for(int j = skin.offsets[i]; j < skin.offsets[i + 1]; j++) {
+            stream.writeInt(boneConv.value(skin.bones[j]));
+            stream.writeFloat(skin.weights[j]);
         }
     }
-
-    float endPos = stream.pos();
-    stream.seek(posTotalSize);
-    stream.writeInt(endPos - posTotalSize - 4);
 }
 
 // Returns a map that maps from oldBoneIndex to newBoneIndex
@@ -265,9 +506,31 @@ QMap<int, int> Model::writeBones(LxStream &stream) {
     return boneConv;
 }
 
-void Model::exportMDL(QString filename) {
+// If a batch is given, the file is only written once the batch is flushed.
+void Model::exportMDL(QString filename, LxBatchWriter *batch) {
 
-    LxStream stream(filename, LxStream::WriteOnly);
+    // A mesh too large for its size field fails before anything is written
+    MeshPools pools = buildPools();
+    if(meshSize(MESH_NAME, pools) > std::numeric_limits<int>::max()) {
+        qDebug() << "Couldn't write" << filename << ": the mesh is larger than 2 GB";
+        return;
+    }
+
+    // Rough size of the file, so the memory stream doesn't need to grow
+    long long sizeHint = 4096 + skeleton.numBones() * 128
+            + (long long)faces.length() * 17 * 4
+            + (long long)geometry.positionCount() * 12
+            + (long long)geometry.normalCount() * 12
+            + (long long)geometry.uvCount() * 8
+            + (long long)geometry.vertexWeights.vertexCount() * 4
+            + (long long)geometry.vertexWeights.influenceCount() * 8;
+
+    LxStream stream;
+    if(batch) {
+        batch->open(stream, filename, sizeHint);
+    } else {
+        stream.openAtomicFile(filename, sizeHint);
+    }
 
     QMap<int, int> boneConv;
 
@@ -277,103 +540,1149 @@ void Model::exportMDL(QString filename) {
     if(skeleton.numBones() != 0) {
         boneConv = writeBones(stream);
     }
-    writeMesh(stream, boneConv);
+    writeMesh(stream, boneConv, pools);
 
-    stream.close();
+    if(!stream.close()) {
+        qDebug() << "Couldn't write" << filename;
+    }
 }
 
 void Model::addSkeleton(Skeleton sk) {
     skeleton = sk;
 }
 
+// Keeps at most maxInfluences bones per vertex, see SkinWeights.
+void Model::limitInfluences(int maxInfluences) {
+    geometry.vertexWeights.limitInfluences(maxInfluences);
+}
+
+// Lays out the assignments of each vertex in file order. The first pass
+// counts the influences per vertex, the second one stores them, so every
+// array is allocated exactly once. Negative vertex indices are dropped.
+void SkinWeights::build(const QVector<BoneAssignment> &assignments, int minVertexCount) {
+    int vertexCount = minVertexCount;
+    for(const BoneAssignment &a : assignments) {
+        vertexCount = qMax(vertexCount, a.vertex + 1);
+    }
+
+    offsets.fill(0, vertexCount + 1);
+    for(const BoneAssignment &a : assignments) {
+        if(a.vertex >= 0) {
+            offsets[a.vertex + 1]++;
+        }
+    }
+    for(int i = 0; i < vertexCount; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    bones.resize(offsets[vertexCount]);
+    weights.resize(offsets[vertexCount]);
+    QVector<int> next = offsets;
+    for(const BoneAssignment &a : assignments) {
+        if(a.vertex < 0) {
+            continue;
+        }
+        int j = next[a.vertex]++;
+        bones[j] = a.weight.boneID;
+        weights[j] = a.weight.weight;
+    }
+
+    if(vertexCount == 0) {
+        offsets.clear();
+    }
+}
+
+// Drops the smallest influences of every vertex that has more than
+// maxInfluences and normalizes the remaining ones to sum to 1. Vertices
+// within the limit are left exactly as they were, so nothing is touched if
+// no vertex exceeds it.
+void SkinWeights::limitInfluences(int maxInfluences) {
+    if(maxInfluences <= 0) {
+        return;
+    }
+
+    int first = 0;
+    while(first < vertexCount() && count(first) <= maxInfluences) {
+        first++;
+    }
+    if(first == vertexCount()) {
+        return;
+    }
+
+    // Compacts in place from the first trimmed row on, rows only ever move
+    // towards the front
+    int out = offsets[first];
+    for(int i = first; i < vertexCount(); i++) {
+        int begin = offsets[i], end = offsets[i + 1];
+        offsets[i] = out;
+
+        if(end - begin <= maxInfluences) {
+            for(int j = begin; j < end; j++, out++) {
+                bones[out] = bones[j];
+                weights[out] = weights[j];
+            }
+            continue;
+        }
+
+        // Stable selection by weight: the heaviest remaining influence moves
+        // to the front and the ones it passes keep their order, so ties keep
+        // the earlier influence
+        float sum = 0;
+        for(int k = 0; k < maxInfluences; k++) {
+            int best = begin + k;
+            for(int j = best + 1; j < end; j++) {
+                if(weights[j] > weights[best]) {
+                    best = j;
+                }
+            }
+            int bone = bones[best];
+            float weight = weights[best];
+            for(int j = best; j > begin + k; j--) {
+                bones[j] = bones[j - 1];
+                weights[j] = weights[j - 1];
+            }
+            bones[begin + k] = bone;
+            weights[begin + k] = weight;
+            sum += weight;
+        }
+
+        // Renormalized while the row is moved into place
+        float scale = sum > 0 ? 1.0f / sum : 1.0f;
+        for(int k = 0; k < maxInfluences; k++, out++) {
+            bones[out] = bones[begin + k];
+            weights[out] = weights[begin + k] * scale;
+        }
+    }
+    offsets[vertexCount()] = out;
+    bones.resize(out);
+    weights.resize(out);
+}
+
+// Welded vertices may differ by this much in each bone weight
+const float WELD_WEIGHT_TOLERANCE = 0.001f;
+
+// Grid buckets searched by one job of the welding pass
+const int WELD_PIECE_BUCKETS = 16384;
+
+// Vertices bucketed by the hash of their grid cell, in compressed rows like
+// SkinWeights. The cells are twice the position tolerance wide, so vertices
+// that can be welded always sit in neighbouring cells.
+struct WeldGrid {
+    const Geometry *geo;
+    float positionTolerance, normalTolerance, uvTolerance;
+    uint mask;
+    QVector<qint64> cells; // x, y and z cell of every vertex
+    QVector<int> offsets;
+    QVector<int> vertices;
+    QVector<int> parents;
+};
+
+struct WeldPiece {
+    WeldGrid *grid;
+    int begin;
+    int end;
+};
+
+static qint64 weldCell(float x, double scale) {
+    double c = std::floor(x * scale);
+    return c > -1e15 && c < 1e15 ? (qint64)c : 0;
+}
+
+static uint cellHash(qint64 x, qint64 y, qint64 z) {
+    uint h = mixHash(uint(x), uint(x >> 32));
+    h = mixHash(mixHash(h, uint(y)), uint(y >> 32));
+    return mixHash(mixHash(h, uint(z)), uint(z >> 32));
+}
+
+// True if the first count entries of both vertices are within tolerance.
+// A vertex that has the attribute is never welded to one that hasn't.
+static bool closeTo(const QVector<float> &values, int count, int a, int b, float tolerance) {
+    if((a < count) != (b < count)) {
+        return false;
+    }
+    return a >= count || qAbs(values[a] - values[b]) <= tolerance;
+}
+
+static bool weldable(const WeldGrid &grid, int a, int b) {
+    const Geometry &g = *grid.geo;
+    int n = g.positionCount();
+    float tolerance = grid.positionTolerance;
+    if(!closeTo(g.positionX, n, a, b, tolerance) || !closeTo(g.positionY, n, a, b, tolerance)
+            || !closeTo(g.positionZ, n, a, b, tolerance)) {
+        return false;
+    }
+
+    n = g.normalCount();
+    tolerance = grid.normalTolerance;
+    if(tolerance >= 0 && (!closeTo(g.normalX, n, a, b, tolerance) || !closeTo(g.normalY, n, a, b, tolerance)
+                          || !closeTo(g.normalZ, n, a, b, tolerance))) {
+        return false;
+    }
+
+    n = g.uvCount();
+    tolerance = grid.uvTolerance;
+    if(tolerance >= 0 && (!closeTo(g.texU, n, a, b, tolerance) || !closeTo(g.texV, n, a, b, tolerance))) {
+        return false;
+    }
+
+    // Same bones in the same order, with close weights
+    const SkinWeights &skin = g.vertexWeights;
+    int countA = a < skin.vertexCount() ? skin.count(a) : 0;
+    int countB = b < skin.vertexCount() ? skin.count(b) : 0;
+    if(countA != countB) {
+        return false;
+    }
+    for(int k = 0; k < countA; k++) {
+        int ja = skin.offsets[a] + k, jb = skin.offsets[b] + k;
+        if(skin.bones[ja] != skin.bones[jb] || qAbs(skin.weights[ja] - skin.weights[jb]) > WELD_WEIGHT_TOLERANCE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The lowest-numbered vertex below v in the cells around it that v can be
+// welded to and that accept() takes, or v if there is none.
+template <typename Accept>
+static int lowestWeldable(const WeldGrid &grid, int v, Accept accept) {
+    const qint64 *cell = grid.cells.constData() + v * 3;
+    int lowest = v;
+    for(int dx = -1; dx <= 1; dx++) {
+        for(int dy = -1; dy <= 1; dy++) {
+            for(int dz = -1; dz <= 1; dz++) {
+                uint other = cellHash(cell[0] + dx, cell[1] + dy, cell[2] + dz) & grid.mask;
+                // Buckets are in vertex order, nothing past lowest can beat it
+                for(int j = grid.offsets[other]; j < grid.offsets[other + 1]; j++) {
+                    int u = grid.vertices[j];
+                    if(u >= lowest) {
+                        break;
+                    }
+                    if(accept(u) && weldable(grid, u, v)) {
+                        lowest = u;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return lowest;
+}
+
+static bool anyVertex(int) {
+    return true;
+}
+
+// Finds the lowest-numbered vertex each vertex of the piece's buckets can
+// be welded to. Only the piece's own vertices are written.
+static void findWeldParents(WeldPiece &piece) {
+    WeldGrid &grid = *piece.grid;
+    for(int bucket = piece.begin; bucket < piece.end; bucket++) {
+        for(int k = grid.offsets[bucket]; k < grid.offsets[bucket + 1]; k++) {
+            int v = grid.vertices[k];
+            grid.parents[v] = lowestWeldable(grid, v, anyVertex);
+        }
+    }
+}
+
+// Merges vertices whose positions are within positionTolerance in every
+// coordinate and whose normals, UVs and weights are close as well. A negative
+// normal or UV tolerance leaves that attribute out. In vertex order, each
+// vertex joins the lowest-numbered earlier group whose first vertex it is
+// within tolerance of, or starts a group of its own. That first vertex's
+// attributes are kept, so no member is ever further than the tolerance from
+// what it is replaced with, and the result doesn't depend on the threads.
+// Returns the number of vertices removed; faces that collapse are left in
+// place.
+int Model::weld(float positionTolerance, float normalTolerance, float uvTolerance) {
+    int count = geometry.positionCount();
+    if(count == 0 || !(positionTolerance > 0)) {
+        return 0;
+    }
+
+    WeldGrid grid;
+    grid.geo = &geometry;
+    grid.positionTolerance = positionTolerance;
+    grid.normalTolerance = normalTolerance;
+    grid.uvTolerance = uvTolerance;
+
+    int size = 16;
+    while(size < count * 2) {
+        size *= 2;
+    }
+    grid.mask = size - 1;
+
+    // Counting sort of the vertices by bucket, which keeps them in order
+    double scale = 0.5 / positionTolerance;
+    QVector<uint> buckets(count);
+    grid.cells.resize(count * 3);
+    grid.offsets.fill(0, size + 1);
+    for(int v = 0; v < count; v++) {
+        qint64 *cell = grid.cells.data() + v * 3;
+        cell[0] = weldCell(geometry.positionX[v], scale);
+        cell[1] = weldCell(geometry.positionY[v], scale);
+        cell[2] = weldCell(geometry.positionZ[v], scale);
+        buckets[v] = cellHash(cell[0], cell[1], cell[2]) & grid.mask;
+        grid.offsets[buckets[v] + 1]++;
+    }
+    for(int i = 0; i < size; i++) {
+        grid.offsets[i + 1] += grid.offsets[i];
+    }
+    grid.vertices.resize(count);
+    QVector<int> next = grid.offsets;
+    for(int v = 0; v < count; v++) {
+        grid.vertices[next[buckets[v]]++] = v;
+    }
+
+    grid.parents.resize(count);
+    QVector<WeldPiece> pieces;
+    for(int begin = 0; begin < size; begin += WELD_PIECE_BUCKETS) {
+        pieces.append({&grid, begin, qMin(begin + WELD_PIECE_BUCKETS, size)});
+    }
+    QtConcurrent::blockingMap(pieces, findWeldParents);
+
+    // The lowest weldable vertex is the group to join whenever it starts a
+    // group itself. Only when it was merged into an earlier one are the
+    // cells searched again, for the lowest group start v is close to.
+    // Vertices past the last position are kept as they are.
+    int total = vertexCount();
+    QVector<int> roots(count);
+    QVector<int> newIndex(total);
+    int kept = 0;
+    auto isRoot = [&roots](int u) { return roots[u] == u; };
+    for(int v = 0; v < count; v++) {
+        int root = grid.parents[v];
+        if(root != v && !isRoot(root)) {
+            root = lowestWeldable(grid, v, isRoot);
+        }
+        roots[v] = root;
+        newIndex[v] = root == v ? kept++ : newIndex[root];
+    }
+    for(int v = count; v < total; v++) {
+        newIndex[v] = kept++;
+    }
+
+    if(kept < total) {
+        remapVertices(newIndex, kept);
+    }
+    return total - kept;
+}
+
+// Vertices of the longest attribute, which faces may index
+int Model::vertexCount() const {
+    return qMax(qMax(geometry.positionCount(), geometry.normalCount()),
+                qMax(geometry.uvCount(), geometry.vertexWeights.vertexCount()));
+}
+
+// Moves every vertex v to newIndex[v] and points the faces at the new
+// indices. Every new index must be used; of the vertices that share one the
+// first keeps its attributes and weights. Vertices mapped to -1 are
+// dropped, so no face may use them. newIndex covers vertexCount() vertices
+// and every attribute the model has comes out with newCount entries, the
+// ones that were shorter padded with zeros and empty weight rows.
+void Model::remapVertices(const QVector<int> &newIndex, int newCount) {
+    QVector<int> sources(newCount, -1);
+    for(int v = newIndex.size() - 1; v >= 0; v--) {
+        if(newIndex[v] >= 0) {
+            sources[newIndex[v]] = v;
+        }
+    }
+
+    const Geometry &old = geometry;
+    bool hasPositions = old.positionCount() > 0;
+    bool hasNormals = old.normalCount() > 0;
+    bool hasUVs = old.uvCount() > 0;
+    Geometry g;
+    g.reserve(newCount, hasPositions, hasNormals, hasUVs);
+    for(int v : sources) {
+        Q_ASSERT(v >= 0);
+        if(hasPositions) {
+            if((unsigned int)v < (unsigned int)old.positionCount()) {
+                g.appendPosition(old.positionX[v], old.positionY[v], old.positionZ[v]);
+            } else {
+                g.appendPosition(0, 0, 0);
+            }
+        }
+        if(hasNormals) {
+            if((unsigned int)v < (unsigned int)old.normalCount()) {
+                g.appendNormal(old.normalX[v], old.normalY[v], old.normalZ[v]);
+            } else {
+                g.appendNormal(0, 0, 0);
+            }
+        }
+        if(hasUVs) {
+            if((unsigned int)v < (unsigned int)old.uvCount()) {
+                g.appendUV(old.texU[v], old.texV[v]);
+            } else {
+                g.appendUV(0, 0);
+            }
+        }
+    }
+
+    const SkinWeights &skin = old.vertexWeights;
+    if(skin.vertexCount() > 0) {
+        SkinWeights &weights = g.vertexWeights;
+        weights.offsets.reserve(newCount + 1);
+        weights.bones.reserve(skin.influenceCount());
+        weights.weights.reserve(skin.influenceCount());
+        weights.offsets.append(0);
+        for(int v : sources) {
+            if((unsigned int)v < (unsigned int)skin.vertexCount()) {
+                for(int j = skin.offsets[v]; j < skin.offsets[v + 1]; j++) {
+                    weights.bones.append(skin.bones[j]);
+                    weights.weights.append(skin.weights[j]);
+                }
+            }
+            weights.offsets.append(weights.bones.size());
+        }
+    }
+    geometry = g;
+
+    FaceList remapped;
+    remapped.reserve(faces.length());
+    for(int i = 0; i < faces.size(); i += 3) {
+        remapped.append(poolIndex(newIndex, faces.index(i)),
+                        poolIndex(newIndex, faces.index(i + 1)),
+                        poolIndex(newIndex, faces.index(i + 2)));
+    }
+    faces = remapped;
+}
+
+// Faces whose edges meet at a smaller sine than this have no area
+const double MIN_FACE_SINE = 1e-6;
+
+// Faces that point past the last position can't be measured and are kept
+static bool hasArea(const Geometry &g, const Triangle &t) {
+    int n = g.positionCount();
+    if(t.v1 >= n || t.v2 >= n || t.v3 >= n) {
+        return true;
+    }
+    double ax = (double)g.positionX[t.v2] - g.positionX[t.v1];
+    double ay = (double)g.positionY[t.v2] - g.positionY[t.v1];
+    double az = (double)g.positionZ[t.v2] - g.positionZ[t.v1];
+    double bx = (double)g.positionX[t.v3] - g.positionX[t.v1];
+    double by = (double)g.positionY[t.v3] - g.positionY[t.v1];
+    double bz = (double)g.positionZ[t.v3] - g.positionZ[t.v1];
+    double cx = ay * bz - az * by;
+    double cy = az * bx - ax * bz;
+    double cz = ax * by - ay * bx;
+    double cross = cx * cx + cy * cy + cz * cz;
+    return cross > MIN_FACE_SINE * MIN_FACE_SINE * (ax * ax + ay * ay + az * az) * (bx * bx + by * by + bz * bz);
+}
+
+// The same face starting at its lowest corner, the winding is kept
+static Triangle canonicalFace(const Triangle &t) {
+    if(t.v2 < t.v1 && t.v2 < t.v3) {
+        return {t.v2, t.v3, t.v1};
+    }
+    if(t.v3 < t.v1 && t.v3 < t.v2) {
+        return {t.v3, t.v1, t.v2};
+    }
+    return t;
+}
+
+// Hashes and compares canonical faces
+struct FacePool {
+    const QVector<Triangle> &faces;
+
+    uint operator()(int i) const {
+        const Triangle &t = faces[i];
+        return mixHash(mixHash(uint(t.v1), uint(t.v2)), uint(t.v3));
+    }
+
+    bool operator()(int a, int b) const {
+        const Triangle &s = faces[a], &t = faces[b];
+        return s.v1 == t.v1 && s.v2 == t.v2 && s.v3 == t.v3;
+    }
+};
+
+// Drops faces that point past the last vertex, repeat a corner, have no
+// area or repeat an earlier face with the same winding, then every vertex
+// no remaining face uses. The attribute arrays, weights and face indices
+// are compacted together and keep their order.
+CleanupReport Model::cleanup() {
+    CleanupReport report = {0, 0, 0, 0, 0};
+    const Geometry &g = geometry;
+    int vertices = vertexCount();
+
+    QVector<Triangle> candidates, canonical;
+    candidates.reserve(faces.length());
+    canonical.reserve(faces.length());
+    for(int f = 0; f < faces.length(); f++) {
+        Triangle t = faces.at(f);
+        if((unsigned int)t.v1 >= (unsigned int)vertices || (unsigned int)t.v2 >= (unsigned int)vertices
+                || (unsigned int)t.v3 >= (unsigned int)vertices) {
+            report.invalidFaces++;
+        } else if(t.v1 == t.v2 || t.v2 == t.v3 || t.v3 == t.v1) {
+            report.degenerateFaces++;
+        } else if(!hasArea(g, t)) {
+            report.zeroAreaFaces++;
+        } else {
+            candidates.append(t);
+            canonical.append(canonicalFace(t));
+        }
+    }
+
+    FacePool pool = {canonical};
+    QVector<int> unique;
+    deduplicate(canonical.size(), pool, pool, unique);
+    report.duplicateFaces = canonical.size() - unique.size();
+
+    QVector<int> newIndex(vertices, -1);
+    FaceList kept;
+    kept.reserve(unique.size());
+    for(int i : unique) {
+        const Triangle &t = candidates[i];
+        kept.append(t.v1, t.v2, t.v3);
+        newIndex[t.v1] = newIndex[t.v2] = newIndex[t.v3] = 0;
+    }
+    int used = 0;
+    for(int &i : newIndex) {
+        if(i >= 0) {
+            i = used++;
+        }
+    }
+    report.unusedVertices = vertices - used;
+
+    faces = kept;
+    if(report.unusedVertices > 0) {
+        remapVertices(newIndex, used);
+    }
+    return report;
+}
+
+
+
+// The element readers below work with both QXmlStreamReader and XmlScanner.
+
+// Reads the vertices of a vertex buffer. Like the old DOM walk, every child
+// counts as a vertex and missing attributes are zero.
+template <typename Reader>
+static void readVertices(Reader &xml, bool hasPositions, bool hasNormals, bool hasUVs,
+                         Geometry &geo) {
+    while(xml.readNextStartElement()) {
+        QVector3D position, normal;
+        float u = 0, v = 0;
+        bool gotPosition = false, gotNormal = false, gotUV = false;
+
+        while(xml.readNextStartElement()) {
+            auto name = xml.name();
+            auto attributes = xml.attributes();
+            if(!gotPosition && name == QLatin1String("position")) {
+                position = QVector3D(attributes.value("x").toFloat(),
+                                     attributes.value("y").toFloat(),
+                                     attributes.value("z").toFloat());
+                gotPosition = true;
+            } else if(!gotNormal && name == QLatin1String("normal")) {
+                normal = QVector3D(attributes.value("x").toFloat(),
+                                   attributes.value("y").toFloat(),
+                                   attributes.value("z").toFloat());
+                gotNormal = true;
+            } else if(!gotUV && name == QLatin1String("texcoord")) {
+                u = attributes.value("u").toFloat();
+                v = attributes.value("v").toFloat();
+                gotUV = true;
+            }
+            xml.skipCurrentElement();
+        }
+
+        if(hasPositions) {
+            geo.appendPosition(position.x(), position.y(), position.z());
+        }
+        if(hasNormals) {
+            geo.appendNormal(normal.x(), normal.y(), normal.z());
+        }
+        if(hasUVs) {
+            geo.appendUV(u, v);
+        }
+    }
+}
+
+template <typename Reader>
+static void readFaces(Reader &xml, FaceList &allFaces) {
+    while(xml.readNextStartElement()) {
+        auto attributes = xml.attributes();
+        int v1 = attributes.value("v1").toInt();
+        int v2 = attributes.value("v2").toInt();
+        int v3 = attributes.value("v3").toInt();
+        allFaces.append(v1, v2, v3);
+        xml.skipCurrentElement();
+    }
+}
 
+template <typename Reader>
+static void readAssignments(Reader &xml, QVector<BoneAssignment> &assignments) {
+    while(xml.readNextStartElement()) {
+        auto attributes = xml.attributes();
+        int vertex = attributes.value("vertexindex").toInt();
+        int bone = attributes.value("boneindex").toInt();
+        float weight = attributes.value("weight").toFloat();
+        xml.skipCurrentElement();
 
-Geometry Model::getGeometry(QDomElement mesh) {
+        assignments.append({vertex, {bone, weight}});
+    }
+}
+
+struct VertexPiece {
+    QByteArray data;
+    bool hasPositions, hasNormals, hasUVs;
     Geometry geo;
-    QDomElement sharedgeometry = mesh.firstChildElement("sharedgeometry");
-    QDomNodeList vertexBuffers = sharedgeometry.childNodes();
-    for(int i = 0; i < vertexBuffers.length(); i++) {
-        QDomElement n = vertexBuffers.item(i).toElement();
-        if(n.nodeName() != "vertexbuffer") {
+    bool ok;
+};
+
+struct FacePiece {
+    QByteArray data;
+    FaceList faces;
+    bool ok;
+};
+
+struct BoneAssignmentPiece {
+    QByteArray data;
+    QVector<BoneAssignment> assignments;
+    bool ok;
+};
+
+// Pieces are scanned from the raw bytes first. Anything the scanner doesn't
+// handle is parsed again with QXmlStreamReader.
+static void parseVertexPiece(VertexPiece &piece) {
+    XmlScanner scanner(piece.data.constData(), piece.data.length());
+    readVertices(scanner, piece.hasPositions, piece.hasNormals, piece.hasUVs, piece.geo);
+    piece.ok = !scanner.hasError();
+    if(piece.ok) {
+        return;
+    }
+
+    piece.geo = Geometry();
+    QXmlStreamReader xml;
+    piece.ok = ParallelXml::openPiece(xml, piece.data);
+    readVertices(xml, piece.hasPositions, piece.hasNormals, piece.hasUVs, piece.geo);
+    piece.ok = piece.ok && !xml.hasError();
+}
+
+static void parseFacePiece(FacePiece &piece) {
+    XmlScanner scanner(piece.data.constData(), piece.data.length());
+    readFaces(scanner, piece.faces);
+    piece.ok = !scanner.hasError();
+    if(piece.ok) {
+        return;
+    }
+
+    piece.faces.clear();
+    QXmlStreamReader xml;
+    piece.ok = ParallelXml::openPiece(xml, piece.data);
+    readFaces(xml, piece.faces);
+    piece.ok = piece.ok && !xml.hasError();
+}
+
+static void parseBoneAssignmentPiece(BoneAssignmentPiece &piece) {
+    XmlScanner scanner(piece.data.constData(), piece.data.length());
+    readAssignments(scanner, piece.assignments);
+    piece.ok = !scanner.hasError();
+    if(piece.ok) {
+        return;
+    }
+
+    piece.assignments.clear();
+    QXmlStreamReader xml;
+    piece.ok = ParallelXml::openPiece(xml, piece.data);
+    readAssignments(xml, piece.assignments);
+    piece.ok = piece.ok && !xml.hasError();
+}
+
+// Reads the vertex buffers of <sharedgeometry>. Buffers that were cut out of
+// doc are parsed in pieces on the thread pool and appended in order.
+template <typename Reader>
+bool Model::readSharedGeometry(Reader &xml, Geometry &geo, const ParallelXml::Document *doc) {
+    int vertexCount = xml.attributes().value("vertexcount").toInt();
+
+    while(xml.readNextStartElement()) {
+        if(xml.name() != QLatin1String("vertexbuffer")) {
+            xml.skipCurrentElement();
+            continue;
+        }
+
+        auto attributes = xml.attributes();
+        bool hasPositions = attributes.value("positions") == QLatin1String("true");
+        bool hasNormals = attributes.value("normals") == QLatin1String("true");
+        int textureCoords = attributes.value("texture_coords").toInt();
+        int textureCoordDimensions = attributes.value("texture_coord_dimensions_0").toInt();
+        bool hasUVs = textureCoords == 1 && textureCoordDimensions == 2;
+        geo.reserve(vertexCount, hasPositions, hasNormals, hasUVs);
+
+        if(!doc || !attributes.hasAttribute(ParallelXml::CUT_ATTRIBUTE)) {
+            readVertices(xml, hasPositions, hasNormals, hasUVs, geo);
             continue;
         }
 
-        bool hasPositions = n.attribute("positions") == "true";
-        bool hasNormals = n.attribute("normals") == "true";
-        int textureCoords = n.attribute("texture_coords", "0").toInt();
-        int textureCoordDimensions = n.attribute("texture_coord_dimensions_0", "0").toInt();
+        int section = attributes.value(ParallelXml::CUT_ATTRIBUTE).toInt();
+        QVector<VertexPiece> pieces;
+        for(const QByteArray &data : ParallelXml::split(doc->section(section), "vertex")) {
+            pieces.append({data, hasPositions, hasNormals, hasUVs, Geometry(), false});
+        }
+        QtConcurrent::blockingMap(pieces, parseVertexPiece);
 
-        QDomNodeList vertices = n.childNodes();
-        for(int j = 0; j < vertices.length(); j++) {
-            QDomElement vertex = vertices.item(j).toElement();
-            if(hasPositions) {
-                QDomElement pos = vertex.firstChildElement("position");
-                float x = pos.attribute("x").toFloat();
-                float y = pos.attribute("y").toFloat();
-                float z = pos.attribute("z").toFloat();
-                geo.vertexPositions.append({x, y, z});
+        for(const VertexPiece &piece : pieces) {
+            if(!piece.ok) {
+                return false;
             }
+            geo.append(piece.geo);
+        }
+        xml.skipCurrentElement();
+    }
+    return true;
+}
 
-            if(hasNormals) {
-                QDomElement pos = vertex.firstChildElement("normal");
-                float x = pos.attribute("x").toFloat();
-                float y = pos.attribute("y").toFloat();
-                float z = pos.attribute("z").toFloat();
-                geo.vertexNormals.append({x, y, z});
+// Reads the faces of every submesh into one list.
+template <typename Reader>
+bool Model::readSubmeshes(Reader &xml, FaceList &allFaces, const ParallelXml::Document *doc) {
+    while(xml.readNextStartElement()) {
+        bool gotFaces = false;
+        while(xml.readNextStartElement()) {
+            if(gotFaces || xml.name() != QLatin1String("faces")) {
+                xml.skipCurrentElement();
+                continue;
             }
+            gotFaces = true;
 
-            if(textureCoords == 1 && textureCoordDimensions == 2) {
-                QDomElement pos = vertex.firstChildElement("texcoord");
-                double u = pos.attribute("u").toDouble();
-                double v = pos.attribute("v").toDouble();
-                geo.UVs.append({u, v});
+            auto attributes = xml.attributes();
+            allFaces.reserve(allFaces.length() + attributes.value("count").toInt());
+            if(!doc || !attributes.hasAttribute(ParallelXml::CUT_ATTRIBUTE)) {
+                readFaces(xml, allFaces);
+                continue;
             }
+
+            int section = attributes.value(ParallelXml::CUT_ATTRIBUTE).toInt();
+            QVector<FacePiece> pieces;
+            for(const QByteArray &data : ParallelXml::split(doc->section(section), "face")) {
+                pieces.append({data, FaceList(), false});
+            }
+            QtConcurrent::blockingMap(pieces, parseFacePiece);
+
+            for(const FacePiece &piece : pieces) {
+                if(!piece.ok) {
+                    return false;
+                }
+                allFaces.append(piece.faces);
+            }
+            xml.skipCurrentElement();
         }
     }
+    return true;
+}
+
+// Reads the mesh bone assignments. Like the faces, a large list that was cut
+// out of doc is parsed in pieces; the weights are then added in file order.
+template <typename Reader>
+bool Model::readBoneAssignments(Reader &xml, SkinWeights &weights, const ParallelXml::Document *doc) {
+    QVector<BoneAssignment> assignments;
+    if(!doc || !xml.attributes().hasAttribute(ParallelXml::CUT_ATTRIBUTE)) {
+        readAssignments(xml, assignments);
+    } else {
+        int section = xml.attributes().value(ParallelXml::CUT_ATTRIBUTE).toInt();
+        QVector<BoneAssignmentPiece> pieces;
+        for(const QByteArray &data : ParallelXml::split(doc->section(section), "vertexboneassignment")) {
+            pieces.append({data, QVector<BoneAssignment>(), false});
+        }
+        QtConcurrent::blockingMap(pieces, parseBoneAssignmentPiece);
 
-    geo.vertexWeights = getWeights(mesh);
+        for(const BoneAssignmentPiece &piece : pieces) {
+            if(!piece.ok) {
+                return false;
+            }
+            assignments += piece.assignments;
+        }
+        xml.skipCurrentElement();
+    }
 
-    return geo;
+    weights.build(assignments);
+    return true;
 }
 
-QList<Triangle> Model::getFaces(QDomElement mesh) {
-    QList<Triangle> allFaces;
+// Reads a binary Ogre .mesh straight from a memory mapping. The result
+// matches what the XML loader gives for the same mesh run through
+// OgreXMLConverter: shared geometry, submesh faces and mesh bone assignments.
+Model Model::fromBinaryFile(QString filename) {
+    Model m;
+    LxStream stream;
+    if(!OgreBinary::openFile(stream, filename)) {
+        return m;
+    }
 
-    QDomNodeList submeshes = mesh.firstChildElement("submeshes").childNodes();
-    for(int i = 0; i < submeshes.length(); i++) {
-        QDomElement submesh = submeshes.item(i).toElement();
-        QDomNodeList faces = submesh.firstChildElement("faces").childNodes();
-        for(int j = 0; j < faces.length(); j++) {
-            QDomElement face = faces.item(j).toElement();
-            int v1 = face.attribute("v1").toInt();
-            int v2 = face.attribute("v2").toInt();
-            int v3 = face.attribute("v3").toInt();
+    bool gotGeometry = false;
+    QVector<BoneAssignment> assignments;
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        switch(chunk.id) {
+        case OgreBinary::M_MESH:
+            // The mesh's sub-chunks follow its single field
+            OgreBinary::readBool(stream); // Skeletally animated
+            break;
+        case OgreBinary::M_GEOMETRY:
+            if(gotGeometry) {
+                OgreBinary::skipChunk(stream, chunk);
+            } else if(readBinaryGeometry(stream, m.geometry)) {
+                gotGeometry = true;
+            } else {
+                // Like a broken XML document, a broken buffer yields an
+                // empty model instead of reading on from the wrong offset
+                qDebug() << "Couldn't read" << filename;
+                return Model();
+            }
+            break;
+        case OgreBinary::M_SUBMESH:
+            readBinarySubmesh(stream, m.faces);
+            break;
+        case OgreBinary::M_MESH_BONE_ASSIGNMENT: {
+            int vertex = stream.readInt();
+            int bone = (unsigned short)stream.readShort();
+            float weight = stream.readFloat();
 
-            allFaces.append({v1, v2, v3});
+            assignments.append({vertex, {bone, weight}});
+            break;
+        }
+        default:
+            OgreBinary::skipChunk(stream, chunk);
         }
     }
 
-    return allFaces;
+    stream.close();
+    m.geometry.vertexWeights.build(assignments);
+    return m;
 }
 
-QList<WeightEntry> Model::getWeights(QDomElement mesh) {
-    QList<WeightEntry> weights;
+struct VertexElement {
+    int source;
+    int type;
+    int semantic;
+    int offset;
+};
+
+// Reads up to count float components of an element. Components the element
+// doesn't have are left untouched. Vertices are taken from the decoded
+// buffer when there is one, otherwise straight from the stream.
+static void readElement(LxStream &stream, const float *vertex, long long vertexStart, int vertexSize,
+                        const VertexElement &e, float *out, int count) {
+    if(e.type < OgreBinary::VET_FLOAT1 || e.type > OgreBinary::VET_FLOAT4) {
+        return;
+    }
+    int components = qMin(e.type - OgreBinary::VET_FLOAT1 + 1, count);
+    if(e.offset + components * 4 > vertexSize) {
+        return;
+    }
+
+    if(vertex) {
+        memcpy(out, vertex + e.offset / 4, components * sizeof(float));
+    } else {
+        stream.seek(vertexStart + e.offset);
+        for(int i = 0; i < components; i++) {
+            out[i] = stream.readFloat();
+        }
+    }
+}
 
-    QDomNodeList boneAssignments = mesh.firstChildElement("boneassignments").childNodes();
+// Returns false if a vertex buffer is cut short, which leaves the stream
+// inside the geometry chunk.
+bool Model::readBinaryGeometry(LxStream &stream, Geometry &geo) {
+    int vertexCount = stream.readInt();
+    QList<VertexElement> elements;
+
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        if(chunk.id == OgreBinary::M_GEOMETRY_VERTEX_DECLARATION) {
+            OgreBinary::Chunk element;
+            while(OgreBinary::readChunk(stream, element)) {
+                if(element.id != OgreBinary::M_GEOMETRY_VERTEX_ELEMENT) {
+                    OgreBinary::unreadChunk(stream);
+                    break;
+                }
+                VertexElement e;
+                e.source = (unsigned short)stream.readShort();
+                e.type = (unsigned short)stream.readShort();
+                e.semantic = (unsigned short)stream.readShort();
+                e.offset = (unsigned short)stream.readShort();
+                stream.readShort(); // Index
+                elements.append(e);
+                OgreBinary::skipChunk(stream, element);
+            }
+        } else if(chunk.id == OgreBinary::M_GEOMETRY_VERTEX_BUFFER) {
+            int bindIndex = (unsigned short)stream.readShort();
+            int vertexSize = (unsigned short)stream.readShort();
+
+            OgreBinary::Chunk data;
+            if(!OgreBinary::readChunk(stream, data) || data.id != OgreBinary::M_GEOMETRY_VERTEX_BUFFER_DATA
+                    || data.end - stream.pos() < (long long)vertexCount * vertexSize) {
+                qDebug() << "Invalid vertex buffer";
+                return false;
+            }
 
-    for(int i = 0; i < boneAssignments.length(); i++) {
-        QDomElement assignment = boneAssignments.item(i).toElement();
-        int vertex = assignment.attribute("vertexindex").toInt();
-        int bone = assignment.attribute("boneindex").toInt();
-        float weight = assignment.attribute("weight").toFloat();
+            // Same flags the XML converter writes for this buffer
+            const VertexElement *position = 0, *normal = 0, *uv = 0;
+            int textureCoords = 0;
+            bool aligned = vertexSize % 4 == 0 && vertexSize > 0;
+            for(const VertexElement &e : elements) {
+                if(e.source != bindIndex) {
+                    continue;
+                }
+                if(e.semantic == OgreBinary::VES_POSITION) {
+                    position = &e;
+                } else if(e.semantic == OgreBinary::VES_NORMAL) {
+                    normal = &e;
+                } else if(e.semantic == OgreBinary::VES_TEXTURE_COORDINATES) {
+                    textureCoords++;
+                    if(!uv) {
+                        uv = &e;
+                    }
+                }
+                aligned = aligned && e.offset % 4 == 0;
+            }
+            if(textureCoords != 1 || uv->type != OgreBinary::VET_FLOAT2) {
+                uv = 0;
+            }
+            geo.reserve(vertexCount, position, normal, uv);
+
+            // Decode the whole buffer at once, swapped to host order. Buffers
+            // with 16-bit elements are read one element at a time instead.
+            long long dataStart = stream.pos();
+            int floatsPerVertex = vertexSize / 4;
+            QVector<float> floats;
+            if(aligned) {
+                floats.resize(vertexCount * floatsPerVertex);
+                stream.readArray(floats.data(), floats.size());
+            }
 
-        while(weights.length() <= vertex) {
-            weights.append(WeightEntry());
+            for(int i = 0; i < vertexCount; i++) {
+                const float *vertex = aligned ? floats.constData() + i * floatsPerVertex : 0;
+                long long vertexStart = dataStart + (long long)i * vertexSize;
+
+                if(position) {
+                    float p[3] = {0, 0, 0};
+                    readElement(stream, vertex, vertexStart, vertexSize, *position, p, 3);
+                    geo.appendPosition(p[0], p[1], p[2]);
+                }
+                if(normal) {
+                    float n[3] = {0, 0, 0};
+                    readElement(stream, vertex, vertexStart, vertexSize, *normal, n, 3);
+                    geo.appendNormal(n[0], n[1], n[2]);
+                }
+                if(uv) {
+                    float t[2] = {0, 0};
+                    readElement(stream, vertex, vertexStart, vertexSize, *uv, t, 2);
+                    geo.appendUV(t[0], t[1]);
+                }
+            }
+            OgreBinary::skipChunk(stream, data);
+        } else {
+            OgreBinary::unreadChunk(stream);
+            break;
         }
+        OgreBinary::skipChunk(stream, chunk);
+    }
+    return true;
+}
 
-        WeightEntry &we = weights[vertex];
-        we.weights.append({bone, weight});
+// Appends the triangles of a submesh. Its own geometry and bone assignments
+// are skipped, just like the XML loader does.
+void Model::readBinarySubmesh(LxStream &stream, FaceList &allFaces) {
+    OgreBinary::readString(stream); // Material
+    bool useSharedVertices = OgreBinary::readBool(stream);
+    int indexCount = stream.readInt();
+    bool indexes32Bit = OgreBinary::readBool(stream);
+
+    if(indexes32Bit) {
+        QVector<unsigned int> indices(indexCount);
+        stream.readArray(indices.data(), indexCount);
+        allFaces.reserve(allFaces.length() + indexCount / 3);
+        for(int i = 0; i + 2 < indexCount; i += 3) {
+            allFaces.append(indices[i], indices[i + 1], indices[i + 2]);
+        }
+    } else {
+        QVector<unsigned short> indices(indexCount);
+        stream.readArray(indices.data(), indexCount);
+        allFaces.reserve(allFaces.length() + indexCount / 3);
+        for(int i = 0; i + 2 < indexCount; i += 3) {
+            allFaces.append(indices[i], indices[i + 1], indices[i + 2]);
+        }
     }
 
-    return weights;
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        if((chunk.id == OgreBinary::M_GEOMETRY && !useSharedVertices)
+                || chunk.id == OgreBinary::M_SUBMESH_OPERATION
+                || chunk.id == OgreBinary::M_SUBMESH_BONE_ASSIGNMENT
+                || chunk.id == OgreBinary::M_SUBMESH_TEXTURE_ALIAS) {
+            OgreBinary::skipChunk(stream, chunk);
+        } else {
+            OgreBinary::unreadChunk(stream);
+            break;
+        }
+    }
+}
+
+// Reads the skinned mesh of a .glb file. Its triangle primitives are appended
+// into one vertex list like Ogre's shared geometry, and the bone ids are the
+// skin's joint indices, which Skeleton::fromGltf() uses as well.
+Model Model::fromGltfFile(QString filename) {
+    Model m;
+    Gltf::File file;
+    if(!Gltf::openFile(file, filename)) {
+        return m;
+    }
+
+    int mesh = -1;
+    Gltf::findSkin(file, &mesh);
+    QJsonArray primitives = Gltf::object(file, "meshes", mesh).value("primitives").toArray();
+
+    Geometry &geo = m.geometry;
+    QVector<BoneAssignment> assignments;
+    for(const QJsonValue &value : primitives) {
+        QJsonObject primitive = value.toObject();
+        QJsonObject attributes = primitive.value("attributes").toObject();
+        if(primitive.value("mode").toInt(Gltf::TRIANGLES) != Gltf::TRIANGLES) {
+            qDebug() << "Skipping a primitive that is not a triangle list";
+            continue;
+        }
+
+        QVector<float> positions;
+        int components = 0;
+        if(!attributes.contains("POSITION")
+                || !Gltf::readFloats(file, attributes.value("POSITION").toInt(), positions, components)
+                || components != 3) {
+            qDebug() << "Skipping a primitive without positions";
+            continue;
+        }
+
+        int base = geo.positionCount();
+        int count = positions.size() / 3;
+
+        // Missing normals and UVs are filled with zeros so every list keeps
+        // one entry per vertex.
+        QVector<float> normals, uvs;
+        if(!attributes.contains("NORMAL")
+                || !Gltf::readFloats(file, attributes.value("NORMAL").toInt(), normals, components)
+                || components != 3 || normals.size() != positions.size()) {
+            normals.fill(0, count * 3);
+        }
+        if(!attributes.contains("TEXCOORD_0")
+                || !Gltf::readFloats(file, attributes.value("TEXCOORD_0").toInt(), uvs, components)
+                || components != 2 || uvs.size() != count * 2) {
+            uvs.fill(0, count * 2);
+        }
+
+        geo.reserve(base + count);
+        for(int i = 0; i < count; i++) {
+            geo.appendPosition(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]);
+            geo.appendNormal(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+            geo.appendUV(uvs[i * 2], uvs[i * 2 + 1]);
+        }
+
+        // Every JOINTS_n/WEIGHTS_n set adds up to four influences
+        for(int set = 0; attributes.contains("JOINTS_" + QString::number(set)); set++) {
+            QVector<int> joints;
+            QVector<float> jointWeights;
+            int jointComponents = 0, weightComponents = 0;
+            if(!Gltf::readInts(file, attributes.value("JOINTS_" + QString::number(set)).toInt(), joints, jointComponents)
+                    || !Gltf::readFloats(file, attributes.value("WEIGHTS_" + QString::number(set)).toInt(-1),
+                                         jointWeights, weightComponents)
+                    || jointComponents != 4 || weightComponents != 4
+                    || joints.size() != count * 4 || jointWeights.size() != count * 4) {
+                qDebug() << "Invalid joint set" << set;
+                break;
+            }
+            for(int i = 0; i < count * 4; i++) {
+                if(jointWeights[i] > 0) {
+                    assignments.append({base + i / 4, {joints[i], jointWeights[i]}});
+                }
+            }
+        }
+        QVector<int> indices;
+        if(primitive.contains("indices")) {
+            if(!Gltf::readInts(file, primitive.value("indices").toInt(), indices, components) || components != 1) {
+                qDebug() << "Invalid indices";
+                continue;
+            }
+        } else {
+            indices.resize(count);
+            for(int i = 0; i < count; i++) {
+                indices[i] = i;
+            }
+        }
+
+        m.faces.reserve(m.faces.length() + indices.size() / 3);
+        for(int i = 0; i + 2 < indices.size(); i += 3) {
+            if((unsigned int)indices[i] >= (unsigned int)count || (unsigned int)indices[i + 1] >= (unsigned int)count
+                    || (unsigned int)indices[i + 2] >= (unsigned int)count) {
+                qDebug() << "Index out of range in face" << i / 3;
+                continue;
+            }
+            m.faces.append(base + indices[i], base + indices[i + 1], base + indices[i + 2]);
+        }
+    }
+
+    geo.vertexWeights.build(assignments, geo.positionCount());
+    return m;
+}
+
+static void writeFloats(LxStream &stream, const QVector<float> &floats) {
+    stream.writeInt(floats.size());
+    stream.writeArray(floats.constData(), floats.size());
+}
+
+static void readFloats(LxStream &stream, QVector<float> &floats) {
+    floats.resize(stream.readInt());
+    stream.readArray(floats.data(), floats.size());
+}
+
+// Geometry and faces as the same flat arrays they are kept in, see AssetCache.
+void Model::writeCache(LxStream &stream) const {
+    writeFloats(stream, geometry.positionX);
+    writeFloats(stream, geometry.positionY);
+    writeFloats(stream, geometry.positionZ);
+    writeFloats(stream, geometry.normalX);
+    writeFloats(stream, geometry.normalY);
+    writeFloats(stream, geometry.normalZ);
+    writeFloats(stream, geometry.texU);
+    writeFloats(stream, geometry.texV);
+
+    const SkinWeights &skin = geometry.vertexWeights;
+    stream.writeInt(skin.offsets.size());
+    stream.writeArray(skin.offsets.constData(), skin.offsets.size());
+    stream.writeInt(skin.bones.size());
+    stream.writeArray(skin.bones.constData(), skin.bones.size());
+    stream.writeArray(skin.weights.constData(), skin.weights.size());
+
+    stream.writeChar(faces.wide);
+    stream.writeInt(faces.size());
+    if(faces.wide) {
+        stream.writeArray(faces.wideIndices.constData(), faces.wideIndices.size());
+    } else {
+        stream.writeArray(faces.narrowIndices.constData(), faces.narrowIndices.size());
+    }
+}
+
+void Model::readCache(LxStream &stream) {
+    readFloats(stream, geometry.positionX);
+    readFloats(stream, geometry.positionY);
+    readFloats(stream, geometry.positionZ);
+    readFloats(stream, geometry.normalX);
+    readFloats(stream, geometry.normalY);
+    readFloats(stream, geometry.normalZ);
+    readFloats(stream, geometry.texU);
+    readFloats(stream, geometry.texV);
+
+    SkinWeights &skin = geometry.vertexWeights;
+    skin.offsets.resize(stream.readInt());
+    stream.readArray(skin.offsets.data(), skin.offsets.size());
+    skin.bones.resize(stream.readInt());
+    skin.weights.resize(skin.bones.size());
+    stream.readArray(skin.bones.data(), skin.bones.size());
+    stream.readArray(skin.weights.data(), skin.weights.size());
+
+    faces.clear();
+    faces.wide = stream.readChar();
+    if(faces.wide) {
+        faces.wideIndices.resize(stream.readInt());
+        stream.readArray(faces.wideIndices.data(), faces.wideIndices.size());
+    } else {
+        faces.narrowIndices.resize(stream.readInt());
+        stream.readArray(faces.narrowIndices.data(), faces.narrowIndices.size());
+    }
 }
@@ -4,23 +4,21 @@
 #include <QList>
 #include <QString>
 #include <QMap>
+#include <QVector>
 #include <QtGui/QVector3D>
 #include <QtGui/QMatrix4x4>
 #include "Skeleton.h"
 
-class QDomElement;
-class QDomDocument;
+class QByteArray;
+namespace ParallelXml { struct Document; }
 class LxStream;
+class LxBatchWriter;
 class Skeleton;
 
 struct Vector3 {
     double x, y, z;
 };
 
-struct Vector2 {
-    double x, y;
-};
-
 struct Triangle {
     int v1;
     int v2;
@@ -32,39 +30,225 @@ struct Weight {
     float weight;
 };
 
-struct WeightEntry {
-    QList<Weight> weights;
+struct BoneAssignment {
+    int vertex;
+    Weight weight;
 };
 
+// Skin weights in compressed sparse rows: the influences of vertex i are
+// bones[j] and weights[j] for offsets[i] <= j < offsets[i + 1].
+struct SkinWeights {
+    QVector<int> offsets;
+    QVector<int> bones;
+    QVector<float> weights;
+
+    int vertexCount() const { return offsets.isEmpty() ? 0 : offsets.size() - 1; }
+    int influenceCount() const { return bones.size(); }
+    int count(int vertex) const { return offsets[vertex + 1] - offsets[vertex]; }
+
+    void build(const QVector<BoneAssignment> &assignments, int minVertexCount = 0);
+    void limitInfluences(int maxInfluences);
+};
+
+// Vertex attributes with one contiguous float array per component. An
+// attribute the mesh doesn't have stays empty.
 struct Geometry {
-    QList<QVector3D> vertexPositions;
-    QList<QVector3D> vertexNormals;
-    QList<Vector2> UVs;
-    QList<WeightEntry> vertexWeights;
+    QVector<float> positionX, positionY, positionZ;
+    QVector<float> normalX, normalY, normalZ;
+    QVector<float> texU, texV;
+    SkinWeights vertexWeights;
+
+    int positionCount() const { return positionX.size(); }
+    int normalCount() const { return normalX.size(); }
+    int uvCount() const { return texU.size(); }
+
+    void reserve(int vertexCount, bool positions = true, bool normals = true, bool uvs = true) {
+        if(positions) {
+            positionX.reserve(vertexCount);
+            positionY.reserve(vertexCount);
+            positionZ.reserve(vertexCount);
+        }
+        if(normals) {
+            normalX.reserve(vertexCount);
+            normalY.reserve(vertexCount);
+            normalZ.reserve(vertexCount);
+        }
+        if(uvs) {
+            texU.reserve(vertexCount);
+            texV.reserve(vertexCount);
+        }
+    }
+
+    void appendPosition(float x, float y, float z) {
+        positionX.append(x);
+        positionY.append(y);
+        positionZ.append(z);
+    }
+
+    void appendNormal(float x, float y, float z) {
+        normalX.append(x);
+        normalY.append(y);
+        normalZ.append(z);
+    }
+
+    void appendUV(float u, float v) {
+        texU.append(u);
+        texV.append(v);
+    }
+
+    // Appends the positions, normals and UVs of other
+    void append(const Geometry &other) {
+        positionX += other.positionX;
+        positionY += other.positionY;
+        positionZ += other.positionZ;
+        normalX += other.normalX;
+        normalY += other.normalY;
+        normalZ += other.normalZ;
+        texU += other.texU;
+        texV += other.texV;
+    }
+};
+
+// Triangle corners, three indices per face. They are kept in 16 bits as long
+// as every index fits and widened to 32 bits once one doesn't.
+class FaceList {
+public:
+    FaceList() : wide(false) {}
+
+    int length() const { return size() / 3; }
+    bool isEmpty() const { return size() == 0; }
+    bool isWide() const { return wide; }
+
+    // Index of the i-th corner
+    int index(int i) const { return wide ? wideIndices[i] : narrowIndices[i]; }
+    Triangle at(int face) const { return {index(face * 3), index(face * 3 + 1), index(face * 3 + 2)}; }
+
+    void reserve(int faces) {
+        if(wide) {
+            wideIndices.reserve(faces * 3);
+        } else {
+            narrowIndices.reserve(faces * 3);
+        }
+    }
+
+    void append(int v1, int v2, int v3) {
+        if(!wide && (unsigned int)(v1 | v2 | v3) > 0xFFFF) {
+            widen();
+        }
+        if(wide) {
+            wideIndices.append(v1);
+            wideIndices.append(v2);
+            wideIndices.append(v3);
+        } else {
+            narrowIndices.append(v1);
+            narrowIndices.append(v2);
+            narrowIndices.append(v3);
+        }
+    }
+
+    void append(const FaceList &other) {
+        if(!wide && other.wide) {
+            widen();
+        }
+        if(!wide) {
+            narrowIndices += other.narrowIndices;
+        } else if(other.wide) {
+            wideIndices += other.wideIndices;
+        } else {
+            wideIndices.reserve(wideIndices.size() + other.size());
+            for(quint16 i : other.narrowIndices) {
+                wideIndices.append(i);
+            }
+        }
+    }
+
+    void clear() {
+        narrowIndices.clear();
+        wideIndices.clear();
+        wide = false;
+    }
+
+private:
+    friend class Model;
+
+    int size() const { return wide ? wideIndices.size() : narrowIndices.size(); }
+
+    void widen() {
+        wideIndices.reserve(qMax(narrowIndices.capacity(), narrowIndices.size() + 3));
+        for(quint16 i : narrowIndices) {
+            wideIndices.append(i);
+        }
+        narrowIndices = QVector<quint16>();
+        wide = true;
+    }
+
+    QVector<quint16> narrowIndices;
+    QVector<int> wideIndices;
+    bool wide;
+};
+
+// The MDL indexes positions, normals, UVs and weights separately for every
+// face corner, so each pool is written without duplicates. The pools list
+// the vertex each entry is taken from, the maps give the entry of a vertex.
+struct MeshPools {
+    QVector<int> positions, normals, uvs, weights;
+    QVector<int> positionMap, normalMap, uvMap, weightMap;
+};
+
+// What Model::cleanup removed
+struct CleanupReport {
+    int invalidFaces;
+    int degenerateFaces;
+    int zeroAreaFaces;
+    int duplicateFaces;
+    int unusedVertices;
 };
 
 class Model
 {
 public:
     Model();
-    static Model fromFile(QString filename);
+    static Model fromFile(QString filename, bool parallel = false);
     static Model dummy();
-    void exportMDL(QString filename);
+    void exportMDL(QString filename, LxBatchWriter *batch = 0);
     void addSkeleton(Skeleton skeleton);
+    void limitInfluences(int maxInfluences);
+    int weld(float positionTolerance, float normalTolerance = 0.001f, float uvTolerance = 0.0001f);
+    CleanupReport cleanup();
 
 private:
-    static Geometry getGeometry(QDomElement mesh);
-    static QList<Triangle> getFaces(QDomElement mesh);
-    static QList<WeightEntry> getWeights(QDomElement mesh);
+    static Model parseFile(QString filename, bool parallel);
+    void writeCache(LxStream &stream) const;
+    void readCache(LxStream &stream);
+
+    static bool parseMesh(const QByteArray &data, Model &m, const ParallelXml::Document *doc, QString *error = 0);
+    template <typename Reader>
+    static bool readMesh(Reader &xml, Model &m, const ParallelXml::Document *doc);
+    template <typename Reader>
+    static bool readSharedGeometry(Reader &xml, Geometry &geo, const ParallelXml::Document *doc);
+    template <typename Reader>
+    static bool readSubmeshes(Reader &xml, FaceList &allFaces, const ParallelXml::Document *doc);
+    template <typename Reader>
+    static bool readBoneAssignments(Reader &xml, SkinWeights &weights, const ParallelXml::Document *doc);
+
+    static Model fromBinaryFile(QString filename);
+    static bool readBinaryGeometry(LxStream &stream, Geometry &geo);
+    static void readBinarySubmesh(LxStream &stream, FaceList &allFaces);
+
+    static Model fromGltfFile(QString filename);
 
     void writeHeader(LxStream &stream);
     void writeShaderParams(LxStream &stream);
-    void writeMesh(LxStream &stream, QMap<int, int> boneConv);
+    void writeMesh(LxStream &stream, QMap<int, int> boneConv, const MeshPools &pools);
+    MeshPools buildPools() const;
+    long long meshSize(const QString &name, const MeshPools &pools) const;
     QMap<int, int> writeBones(LxStream &stream);
     void addPseudoBone(QString name, QString parent);
+    int vertexCount() const;
+    void remapVertices(const QVector<int> &newIndex, int newCount);
 
     Geometry geometry;
-    QList<Triangle> faces;
+    FaceList faces;
     Skeleton skeleton;
 };
 
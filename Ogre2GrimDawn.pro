@@ -1,4 +1,4 @@
-QT += core xml
+QT += core xml concurrent
 
 CONFIG += c++11
 
@@ -12,6 +12,12 @@ SOURCES += main.cpp \
     Model.cpp \
     Animation.cpp \
     Utils.cpp \
+    OgreBinary.cpp \
+    ParallelXml.cpp \
+    XmlScanner.cpp \
+    AssetCache.cpp \
+    Gltf.cpp \
+    Triage.cpp \
     Skeleton.cpp
 
 # The following define makes your compiler emit warnings if you use
@@ -20,6 +26,9 @@ SOURCES += main.cpp \
 # deprecated API in order to know how to port your code away from it.
 DEFINES += QT_DEPRECATED_WARNINGS USE_QT
 
+# LxFileStream uses fseeko/ftello, which need a 64-bit off_t on 32-bit targets.
+unix:DEFINES += _FILE_OFFSET_BITS=64
+
 # You can also make your code fail to compile if you use deprecated APIs.
 # In order to do so, uncomment the following line.
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
@@ -29,6 +38,13 @@ HEADERS += \
     main.h \
     Model.h \
     LxStream.h \
+    LxBatchWriter.h \
     Animation.h \
     Utils.h \
+    OgreBinary.h \
+    ParallelXml.h \
+    XmlScanner.h \
+    AssetCache.h \
+    Gltf.h \
+    Triage.h \
     Skeleton.h
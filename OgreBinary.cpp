@@ -0,0 +1,72 @@
+#include "OgreBinary.h"
+
+#include <QString>
+#include <QDebug>
+#include "LxStream.h"
+
+// Maps the file and reads the header chunk. The byte order of the file is
+// taken from the header id, so big-endian exports load as well.
+bool OgreBinary::openFile(LxStream &stream, const QString &filename) {
+    stream.openMappedFile(filename, LxStream::ReadOnly);
+    if(!stream.isOpen()) {
+        qDebug() << "Couldn't open file.";
+        return false;
+    }
+
+    if(stream.size() < 2) {
+        qDebug() << filename << "is not an Ogre binary file.";
+        return false;
+    }
+
+    unsigned short header = stream.read<unsigned short>();
+    if(header == M_HEADER) {
+        stream.setEndianness(LX_HOST_ENDIANNESS);
+    } else if(BYTESWAP_16(header) == M_HEADER) {
+        stream.setEndianness(LX_HOST_ENDIANNESS == LxStream::LittleEndian ? LxStream::BigEndian : LxStream::LittleEndian);
+    } else {
+        qDebug() << filename << "is not an Ogre binary file.";
+        return false;
+    }
+
+    readString(stream); // Serializer version
+    return true;
+}
+
+// Returns false at the end of the stream or when the chunk doesn't fit.
+bool OgreBinary::readChunk(LxStream &stream, Chunk &chunk) {
+    long long start = stream.pos();
+    if(stream.size() - start < CHUNK_HEADER_SIZE) {
+        return false;
+    }
+
+    chunk.id = stream.readShort();
+    unsigned int length = stream.readInt();
+    chunk.end = start + length;
+    if(length < (unsigned int)CHUNK_HEADER_SIZE || chunk.end > stream.size()) {
+        qDebug() << "Invalid chunk" << QString::number(chunk.id, 16) << "at" << start;
+        return false;
+    }
+    return true;
+}
+
+void OgreBinary::skipChunk(LxStream &stream, const Chunk &chunk) {
+    stream.seek(chunk.end);
+}
+
+// Puts back a chunk header that belongs to the parent's caller.
+void OgreBinary::unreadChunk(LxStream &stream) {
+    stream.rewind(CHUNK_HEADER_SIZE);
+}
+
+// Strings are terminated by a newline instead of a null byte.
+QString OgreBinary::readString(LxStream &stream) {
+    QString str = stream.readLine();
+    if(str.endsWith('\n')) {
+        str.chop(1);
+    }
+    return str;
+}
+
+bool OgreBinary::readBool(LxStream &stream) {
+    return stream.readChar() != 0;
+}
@@ -0,0 +1,66 @@
+#ifndef OGREBINARY_H
+#define OGREBINARY_H
+
+class QString;
+class LxStream;
+
+// Helpers for the chunked binary format that Ogre's MeshSerializer and
+// SkeletonSerializer write. Every chunk starts with a 16-bit id and a 32-bit
+// length that includes the header itself.
+namespace OgreBinary {
+    enum ChunkID {
+        M_HEADER = 0x1000,
+        M_MESH = 0x3000,
+        M_SUBMESH = 0x4000,
+        M_SUBMESH_OPERATION = 0x4010,
+        M_SUBMESH_BONE_ASSIGNMENT = 0x4100,
+        M_SUBMESH_TEXTURE_ALIAS = 0x4200,
+        M_GEOMETRY = 0x5000,
+        M_GEOMETRY_VERTEX_DECLARATION = 0x5100,
+        M_GEOMETRY_VERTEX_ELEMENT = 0x5110,
+        M_GEOMETRY_VERTEX_BUFFER = 0x5200,
+        M_GEOMETRY_VERTEX_BUFFER_DATA = 0x5210,
+        M_MESH_BONE_ASSIGNMENT = 0x7000
+    };
+
+    enum SkeletonChunkID {
+        SKELETON_HEADER = 0x1000,
+        SKELETON_BLENDMODE = 0x1010,
+        SKELETON_BONE = 0x2000,
+        SKELETON_BONE_PARENT = 0x3000,
+        SKELETON_ANIMATION = 0x4000,
+        SKELETON_ANIMATION_BASEINFO = 0x4010,
+        SKELETON_ANIMATION_TRACK = 0x4100,
+        SKELETON_ANIMATION_TRACK_KEYFRAME = 0x4110,
+        SKELETON_ANIMATION_LINK = 0x5000
+    };
+
+    enum VertexElementSemantic {
+        VES_POSITION = 1,
+        VES_NORMAL = 4,
+        VES_TEXTURE_COORDINATES = 7
+    };
+
+    enum VertexElementType {
+        VET_FLOAT1 = 0,
+        VET_FLOAT2 = 1,
+        VET_FLOAT3 = 2,
+        VET_FLOAT4 = 3
+    };
+
+    const int CHUNK_HEADER_SIZE = 6;
+
+    struct Chunk {
+        unsigned short id;
+        long long end;
+    };
+
+    bool openFile(LxStream &stream, const QString &filename);
+    bool readChunk(LxStream &stream, Chunk &chunk);
+    void skipChunk(LxStream &stream, const Chunk &chunk);
+    void unreadChunk(LxStream &stream);
+    QString readString(LxStream &stream);
+    bool readBool(LxStream &stream);
+}
+
+#endif // OGREBINARY_H
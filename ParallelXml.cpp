@@ -0,0 +1,131 @@
+#include "ParallelXml.h"
+
+#include <QString>
+#include <QFile>
+#include <QThread>
+#include <QXmlStreamReader>
+#include <QMap>
+#include <QDebug>
+
+// Sections smaller than this are left in place and parsed serially
+const int MIN_SECTION_SIZE = 256 * 1024;
+const int MIN_PIECE_SIZE = 64 * 1024;
+
+QByteArray ParallelXml::Document::section(int index) const {
+    int start = sectionStarts[index];
+    return QByteArray::fromRawData(data.constData() + start, sectionEnds[index] - start);
+}
+
+static bool isNameEnd(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '>' || c == '/';
+}
+
+// Finds the next "<tag" that isn't just the start of a longer name.
+static int findTag(const QByteArray &data, const QByteArray &open, int from, int end) {
+    while(true) {
+        int i = data.indexOf(open, from);
+        if(i < 0 || i + open.length() >= end) {
+            return -1;
+        }
+        if(isNameEnd(data[i + open.length()])) {
+            return i;
+        }
+        from = i + 1;
+    }
+}
+
+// Reads the file and cuts out the content of every large element named in
+// tags. Returns false when the file can't be cut safely; comments and CDATA
+// could hide tags from the byte scan, so files containing them are parsed
+// serially.
+bool ParallelXml::load(const QString &filename, const QList<QByteArray> &tags, Document &doc) {
+    QFile file(filename);
+    if(!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    doc.data = file.readAll();
+    file.close();
+
+    if(doc.data.contains("<!--") || doc.data.contains("<![CDATA[")) {
+        return false;
+    }
+
+    // Start and end of every cut, in file order
+    QMap<int, int> cuts;
+    for(const QByteArray &tag : tags) {
+        const QByteArray open = "<" + tag;
+        const QByteArray close = "</" + tag;
+        int from = 0;
+        int tagStart;
+        while((tagStart = findTag(doc.data, open, from, doc.data.length())) >= 0) {
+            int tagEnd = doc.data.indexOf('>', tagStart);
+            if(tagEnd < 0) {
+                return false;
+            }
+            from = tagEnd + 1;
+            if(doc.data[tagEnd - 1] == '/') {
+                continue;
+            }
+            int contentEnd = doc.data.indexOf(close, from);
+            if(contentEnd < 0) {
+                return false;
+            }
+            if(contentEnd - from >= MIN_SECTION_SIZE) {
+                cuts.insert(tagEnd, contentEnd);
+            }
+            from = contentEnd;
+        }
+    }
+
+    doc.remainder.clear();
+    doc.sectionStarts.clear();
+    doc.sectionEnds.clear();
+
+    int pos = 0;
+    for(auto it = cuts.constBegin(); it != cuts.constEnd(); ++it) {
+        if(it.key() < pos) {
+            return false; // Sections overlap
+        }
+        doc.remainder.append(doc.data.constData() + pos, it.key() - pos);
+        doc.remainder.append(' ');
+        doc.remainder.append(CUT_ATTRIBUTE);
+        doc.remainder.append("=\"" + QByteArray::number(doc.sectionStarts.length()) + "\">");
+        doc.sectionStarts.append(it.key() + 1);
+        doc.sectionEnds.append(it.value());
+        pos = it.value();
+    }
+    doc.remainder.append(doc.data.constData() + pos, doc.data.length() - pos);
+
+    return true;
+}
+
+// Splits a section into pieces that each start at an <element>.
+QList<QByteArray> ParallelXml::split(const QByteArray &section, const QByteArray &element) {
+    int count = qMax(1, qMin(QThread::idealThreadCount() * 4, section.length() / MIN_PIECE_SIZE));
+    int pieceSize = section.length() / count;
+    const QByteArray open = "<" + element;
+
+    QList<QByteArray> pieces;
+    int start = 0;
+    while(start < section.length()) {
+        int end = -1;
+        if(section.length() - start > pieceSize) {
+            end = findTag(section, open, start + pieceSize, section.length());
+        }
+        if(end < 0) {
+            end = section.length();
+        }
+        pieces.append(QByteArray::fromRawData(section.constData() + start, end - start));
+        start = end;
+    }
+    return pieces;
+}
+
+// Feeds a piece to the reader wrapped in a single element and enters it, so
+// that the piece's elements can be read like the children of the section.
+bool ParallelXml::openPiece(QXmlStreamReader &xml, const QByteArray &piece) {
+    xml.addData("<piece>");
+    xml.addData(piece);
+    xml.addData("</piece>");
+    return xml.readNextStartElement();
+}
@@ -0,0 +1,35 @@
+#ifndef PARALLELXML_H
+#define PARALLELXML_H
+
+#include <QByteArray>
+#include <QList>
+
+class QString;
+class QXmlStreamReader;
+
+// Support for parsing the large repeated-element sections of Ogre XML files
+// (vertex buffers, faces, keyframes) on several threads.
+//
+// load() cuts the content of every large section out of the file. What is
+// left is small and parsed as usual; each emptied start tag gets a
+// CUT_ATTRIBUTE with the index of its section. split() breaks a section at
+// element boundaries into pieces that can be parsed independently with
+// openPiece().
+namespace ParallelXml {
+    const char CUT_ATTRIBUTE[] = "lxcut";
+
+    struct Document {
+        QByteArray data;
+        QByteArray remainder;
+        QList<int> sectionStarts;
+        QList<int> sectionEnds;
+
+        QByteArray section(int index) const;
+    };
+
+    bool load(const QString &filename, const QList<QByteArray> &tags, Document &doc);
+    QList<QByteArray> split(const QByteArray &section, const QByteArray &element);
+    bool openPiece(QXmlStreamReader &xml, const QByteArray &piece);
+}
+
+#endif // PARALLELXML_H
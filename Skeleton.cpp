@@ -3,6 +3,15 @@
 #include <QDomElement>
 #include <QDomDocument>
 #include <QtMath>
+#include <QHash>
+#include "LxStream.h"
+#include "OgreBinary.h"
+#include "Gltf.h"
+#include "AssetCache.h"
+#include "XmlScanner.h"
+#include <QFile>
+#include <QXmlStreamReader>
+#include <QDebug>
 
 Skeleton::Skeleton()
 {
@@ -66,10 +75,90 @@ QMap<QString, Bone> Skeleton::getBoneInfo(QDomElement skeleton) {
     return bones;
 }
 
+// Loads the parsed skeleton from its cache if that is up to date, otherwise
+// parses the file and caches the result.
 Skeleton Skeleton::fromFile(QString filename, bool withPrefix)
 {
-    QDomDocument doc = Utils::readXMLFile(filename);
-    return fromDocument(doc, withPrefix);
+    AssetCache cache(filename, withPrefix ? "skeleton" : "skeleton-noprefix");
+    LxStream stream;
+    Skeleton sk;
+    if(cache.load(stream)) {
+        sk.readCache(stream);
+        return sk;
+    }
+
+    sk = parseFile(filename, withPrefix);
+
+    // A failed parse leaves the skeleton empty and is tried again next time
+    if(sk.numBones() == 0) {
+        return sk;
+    }
+
+    QByteArray payload;
+    LxStream out(&payload);
+    out.setBuffered();
+    sk.writeCache(out);
+    out.close();
+    cache.store(payload);
+
+    return sk;
+}
+
+Skeleton Skeleton::parseFile(QString filename, bool withPrefix)
+{
+    if(filename.endsWith(".skeleton", Qt::CaseInsensitive)) {
+        LxStream stream;
+        if(!OgreBinary::openFile(stream, filename)) {
+            return Skeleton();
+        }
+        return fromBinaryStream(stream, withPrefix);
+    }
+    if(filename.endsWith(".glb", Qt::CaseInsensitive)) {
+        Gltf::File file;
+        if(!Gltf::openFile(file, filename)) {
+            return Skeleton();
+        }
+        return fromGltf(file, withPrefix);
+    }
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Couldn't open file.";
+        return Skeleton();
+    }
+
+    // Scanned from the mapped bytes first, a file with anything the scanner
+    // doesn't handle is parsed again with QXmlStreamReader.
+    QByteArray data = Utils::mapFile(file);
+    SkeletonSections sections;
+    XmlScanner scanner(data.constData(), data.length());
+    readSkeleton(scanner, sections);
+    if(scanner.hasError()) {
+        sections = SkeletonSections();
+        QXmlStreamReader xml(data);
+        readSkeleton(xml, sections);
+
+        if(xml.hasError()) {
+            qDebug() << "Couldn't parse" << filename << ":" << xml.errorString();
+            return Skeleton();
+        }
+    }
+
+    return fromSections(sections, withPrefix);
+}
+
+// Only <bones> and <bonehierarchy> are read, the animations that may follow
+// them are never touched.
+template <typename Reader>
+void Skeleton::readSkeleton(Reader &xml, SkeletonSections &sections)
+{
+    if(xml.readNextStartElement() && xml.name() == QLatin1String("skeleton")) {
+        while(!sections.done() && xml.readNextStartElement()) {
+            if(!readSection(xml, sections)) {
+                xml.skipCurrentElement();
+            }
+        }
+    }
 }
 
 Skeleton Skeleton::fromDocument(QDomDocument doc, bool withPrefix)
@@ -102,3 +191,292 @@ Skeleton Skeleton::fromDocument(QDomDocument doc, bool withPrefix)
 
     return ret;
 }
+
+// Reads the bones and the hierarchy of a binary Ogre .skeleton and stops in
+// front of the first animation, which the caller may read next. Names are
+// prefixed the same way fromDocument() does it.
+Skeleton Skeleton::fromBinaryStream(LxStream &stream, bool withPrefix)
+{
+    QMap<QString, Bone> skeleton;
+    QHash<int, QString> names;
+    int i = 0;
+
+    OgreBinary::Chunk chunk;
+    while(OgreBinary::readChunk(stream, chunk)) {
+        if(chunk.id == OgreBinary::SKELETON_ANIMATION) {
+            OgreBinary::unreadChunk(stream);
+            break;
+        }
+
+        if(chunk.id == OgreBinary::SKELETON_BONE) {
+            QString name = OgreBinary::readString(stream);
+            int id = (unsigned short)stream.readShort();
+            if(i != id) {
+                qDebug() << "Error: IDs are not in order :(";
+            }
+            i++;
+            names.insert(id, name);
+
+            // Make sure equipped items don't recognize these bones.
+            if(name != "root") {
+                name = "Dx_" + name;
+            }
+
+            // Position, then the orientation as x, y, z, w
+            float f[7];
+            stream.readArray(f, 7);
+
+            Bone b;
+            b.name = name;
+            b.position = QVector3D(f[0], f[1], f[2]);
+            b.rotation = QQuaternion(f[6], f[3], f[4], f[5]).normalized();
+            b.id = id;
+
+            skeleton.insert(name, b);
+        } else if(chunk.id == OgreBinary::SKELETON_BONE_PARENT) {
+            QString name = names.value((unsigned short)stream.readShort());
+            QString parent = names.value((unsigned short)stream.readShort());
+
+            if(withPrefix && name != "root") {
+                name = "Dx_" + name;
+            }
+
+            if(withPrefix && parent != "root") {
+                parent = "Dx_" + parent;
+            }
+
+            skeleton[name].parent = parent;
+            skeleton[parent].children.append(name);
+        }
+        OgreBinary::skipChunk(stream, chunk);
+    }
+
+    Skeleton ret;
+    ret.bones = skeleton;
+
+    return ret;
+}
+
+void Skeleton::writeCache(LxStream &stream) const
+{
+    stream.writeInt(bones.size());
+    for(auto it = bones.constBegin(); it != bones.constEnd(); ++it) {
+        const Bone &b = it.value();
+        AssetCache::writeString(stream, it.key());
+        AssetCache::writeString(stream, b.name);
+        AssetCache::writeString(stream, b.parent);
+        stream.writeInt(b.children.length());
+        for(const QString &child : b.children) {
+            AssetCache::writeString(stream, child);
+        }
+
+        float f[7] = {
+            b.position.x(), b.position.y(), b.position.z(),
+            b.rotation.scalar(), b.rotation.x(), b.rotation.y(), b.rotation.z()
+        };
+        stream.writeArray(f, 7);
+        stream.writeInt(b.id);
+    }
+}
+
+void Skeleton::readCache(LxStream &stream)
+{
+    int count = stream.readInt();
+    for(int i = 0; i < count; i++) {
+        QString key = AssetCache::readString(stream);
+        Bone b;
+        b.name = AssetCache::readString(stream);
+        b.parent = AssetCache::readString(stream);
+        int children = stream.readInt();
+        for(int j = 0; j < children; j++) {
+            b.children.append(AssetCache::readString(stream));
+        }
+
+        float f[7];
+        stream.readArray(f, 7);
+        b.position = QVector3D(f[0], f[1], f[2]);
+        b.rotation = QQuaternion(f[3], f[4], f[5], f[6]);
+        b.id = stream.readInt();
+
+        bones.insert(key, b);
+    }
+}
+
+// Reads the current element if it is the first <bones> or <bonehierarchy>,
+// with the same rules as getBoneInfo() and fromDocument(). Returns false and
+// leaves the element alone otherwise. Works with both QXmlStreamReader and
+// XmlScanner.
+template <typename Reader>
+bool Skeleton::readSection(Reader &xml, SkeletonSections &sections)
+{
+    if(!sections.gotBones && xml.name() == QLatin1String("bones")) {
+        sections.gotBones = true;
+        int i = 0;
+        while(xml.readNextStartElement()) {
+            auto attributes = xml.attributes();
+            int id = attributes.value("id").toInt();
+            if(i != id) {
+                qDebug() << "Error: IDs are not in order :(";
+            }
+            i++;
+            QString name = attributes.value("name").toString();
+
+            // Make sure equipped items don't recognize these bones.
+            if(name != "root") {
+                name = "Dx_" + name;
+            }
+
+            QVector3D position, axis;
+            float angle = 0;
+            bool gotPosition = false, gotRotation = false;
+            while(xml.readNextStartElement()) {
+                auto child = xml.attributes();
+                if(!gotPosition && xml.name() == QLatin1String("position")) {
+                    position = QVector3D(child.value("x").toFloat(),
+                                         child.value("y").toFloat(),
+                                         child.value("z").toFloat());
+                    gotPosition = true;
+                } else if(!gotRotation && xml.name() == QLatin1String("rotation")) {
+                    angle = child.value("angle").toFloat();
+                    gotRotation = true;
+
+                    bool gotAxis = false;
+                    while(xml.readNextStartElement()) {
+                        if(!gotAxis && xml.name() == QLatin1String("axis")) {
+                            auto axisAttributes = xml.attributes();
+                            axis = QVector3D(axisAttributes.value("x").toFloat(),
+                                             axisAttributes.value("y").toFloat(),
+                                             axisAttributes.value("z").toFloat());
+                            gotAxis = true;
+                        }
+                        xml.skipCurrentElement();
+                    }
+                    continue;
+                }
+                xml.skipCurrentElement();
+            }
+
+            Bone b;
+            b.name = name;
+            b.position = position;
+            b.rotation = QQuaternion::fromAxisAndAngle(axis, qRadiansToDegrees(angle));
+            b.id = id;
+
+            sections.bones.insert(name, b);
+        }
+        return true;
+    }
+
+    if(!sections.gotHierarchy && xml.name() == QLatin1String("bonehierarchy")) {
+        sections.gotHierarchy = true;
+        while(xml.readNextStartElement()) {
+            auto attributes = xml.attributes();
+            sections.parents.append(qMakePair(attributes.value("bone").toString(),
+                                              attributes.value("parent").toString()));
+            xml.skipCurrentElement();
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Animation::parseFile() reads the same sections with either parser
+template bool Skeleton::readSection(QXmlStreamReader &xml, SkeletonSections &sections);
+template bool Skeleton::readSection(XmlScanner &xml, SkeletonSections &sections);
+
+// The joints of the file's skin become the bones, numbered in joint order so
+// the JOINTS_0 values of the mesh are bone ids. Joints without a parent joint
+// hang off "root", which is added unless a joint already has that name.
+Skeleton Skeleton::fromGltf(Gltf::File &file, bool withPrefix)
+{
+    int skin = Gltf::findSkin(file);
+    QJsonArray joints = Gltf::object(file, "skins", skin).value("joints").toArray();
+    QJsonArray nodes = file.json.value("nodes").toArray();
+    QHash<int, QString> names = Gltf::jointNames(file, skin);
+
+    for(auto it = names.begin(); it != names.end(); ++it) {
+        if(withPrefix && it.value() != "root") {
+            it.value() = "Dx_" + it.value();
+        }
+    }
+
+    QHash<int, int> parents;
+    for(int i = 0; i < nodes.size(); i++) {
+        for(const QJsonValue &child : nodes.at(i).toObject().value("children").toArray()) {
+            parents.insert(child.toInt(), i);
+        }
+    }
+
+    QMap<QString, Bone> skeleton;
+    for(int id = 0; id < joints.size(); id++) {
+        int node = joints.at(id).toInt();
+        Gltf::Transform t = Gltf::nodeTransform(nodes.at(node).toObject());
+
+        Bone b;
+        b.name = names.value(node);
+        b.position = t.translation;
+        b.rotation = t.rotation;
+        b.id = id;
+
+        skeleton.insert(b.name, b);
+    }
+
+    if(!joints.isEmpty() && !skeleton.contains("root")) {
+        Bone b;
+        b.name = "root";
+        b.id = joints.size();
+        skeleton.insert(b.name, b);
+    }
+
+    for(int id = 0; id < joints.size(); id++) {
+        int node = joints.at(id).toInt();
+        QString name = names.value(node);
+
+        // Nodes between two joints are skipped
+        int parentNode = parents.value(node, -1);
+        while(parentNode >= 0 && !names.contains(parentNode)) {
+            parentNode = parents.value(parentNode, -1);
+        }
+
+        QString parent = parentNode >= 0 ? names.value(parentNode) : "root";
+        if(name == parent) {
+            continue;
+        }
+
+        skeleton[name].parent = parent;
+        skeleton[parent].children.append(name);
+    }
+
+    Skeleton ret;
+    ret.bones = skeleton;
+
+    return ret;
+}
+
+Skeleton Skeleton::fromSections(const SkeletonSections &sections, bool withPrefix)
+{
+    QMap<QString, Bone> skeleton = sections.bones;
+
+    for(const QPair<QString, QString> &boneparent : sections.parents) {
+        QString name = boneparent.first;
+
+        if(withPrefix && name != "root") {
+            name = "Dx_" + name;
+        }
+
+        QString parent = boneparent.second;
+
+        if(withPrefix && parent != "root") {
+            parent = "Dx_" + parent;
+        }
+
+        skeleton[name].parent = parent;
+        skeleton[parent].children.append(name);
+    }
+
+    Skeleton ret;
+    ret.bones = skeleton;
+
+    return ret;
+}
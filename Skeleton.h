@@ -5,9 +5,13 @@
 #include <QVector3D>
 #include <QMatrix4x4>
 #include <QMap>
+#include <QList>
+#include <QPair>
 
 class QDomElement;
 class QDomDocument;
+class LxStream;
+namespace Gltf { struct File; }
 
 struct Bone {
     QString name;
@@ -18,6 +22,17 @@ struct Bone {
     int id;
 };
 
+// The <bones> and <bonehierarchy> sections of a streamed .SKELETON.xml
+struct SkeletonSections {
+    SkeletonSections() : gotBones(false), gotHierarchy(false) {}
+    bool done() const { return gotBones && gotHierarchy; }
+
+    QMap<QString, Bone> bones;
+    QList<QPair<QString, QString> > parents;
+    bool gotBones;
+    bool gotHierarchy;
+};
+
 class Skeleton
 {
 public:
@@ -26,9 +41,19 @@ public:
     Bone bone(QString name) const;
     static Skeleton fromFile(QString filename, bool withPrefix = true);
     static Skeleton fromDocument(QDomDocument doc, bool withPrefix = true);
+    static Skeleton fromBinaryStream(LxStream &stream, bool withPrefix = true);
+    static Skeleton fromGltf(Gltf::File &file, bool withPrefix = true);
+    template <typename Reader>
+    static bool readSection(Reader &xml, SkeletonSections &sections);
+    static Skeleton fromSections(const SkeletonSections &sections, bool withPrefix = true);
+    void writeCache(LxStream &stream) const;
+    void readCache(LxStream &stream);
     QMap<QString, Bone> bones;
 
 private:
+    static Skeleton parseFile(QString filename, bool withPrefix);
+    template <typename Reader>
+    static void readSkeleton(Reader &xml, SkeletonSections &sections);
     static QMap<QString, Bone> getBoneInfo(QDomElement bones);
 };
 
@@ -0,0 +1,500 @@
+#include "Triage.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QXmlStreamReader>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QFile>
+#include <QSet>
+#include <QDebug>
+#include <QtConcurrent>
+#include "LxStream.h"
+#include "OgreBinary.h"
+#include "ParallelXml.h"
+#include "XmlScanner.h"
+#include "Gltf.h"
+
+// Matches the sampling in Animation::exportAnm()
+const int EXPORT_FPS = 30;
+
+namespace {
+    // Collects the findings for one file
+    class Scan {
+    public:
+        Scan(const QString &filename) {
+            result.insert("file", filename);
+        }
+
+        void vertices(int count) {
+            result.insert("vertices", count);
+            if(count > Triage::MAX_VERTICES) {
+                issues.append(QJsonObject {
+                    {"issue", "vertex-limit"},
+                    {"vertices", count},
+                    {"limit", Triage::MAX_VERTICES}
+                });
+            }
+        }
+
+        void bone(const QString &name) {
+            bones++;
+            if(name.length() > Triage::MAX_BONE_NAME_LENGTH && !longNames.contains(name)) {
+                longNames.insert(name);
+                issues.append(QJsonObject {
+                    {"issue", "bone-name-length"},
+                    {"bone", name},
+                    {"length", name.length()},
+                    {"limit", Triage::MAX_BONE_NAME_LENGTH}
+                });
+            }
+        }
+
+        void animation() {
+            animations++;
+        }
+
+        // Checks that the track has a keyframe at or before the first and
+        // at or after the last frame that gets exported.
+        void track(const QString &animation, const QString &bone, float length,
+                   bool hasKeyframes, float first, float last) {
+            int numFrames = EXPORT_FPS * length;
+            if(numFrames <= 0) {
+                return;
+            }
+            float lastFrame = float(numFrames - 1) / float(EXPORT_FPS);
+
+            if(!hasKeyframes || (last < lastFrame && !qFuzzyCompare(last, lastFrame))) {
+                QJsonObject issue {
+                    {"issue", "missing-trailing-keyframe"},
+                    {"animation", animation},
+                    {"bone", bone},
+                    {"lastFrame", lastFrame}
+                };
+                if(hasKeyframes) {
+                    issue.insert("lastKeyframe", last);
+                }
+                issues.append(issue);
+            }
+            if(hasKeyframes && first > 0) {
+                issues.append(QJsonObject {
+                    {"issue", "missing-first-keyframe"},
+                    {"animation", animation},
+                    {"bone", bone},
+                    {"firstKeyframe", first}
+                });
+            }
+        }
+
+        void fail(const QString &error) {
+            issues.append(QJsonObject {
+                {"issue", "unreadable"},
+                {"error", error}
+            });
+        }
+
+        QJsonObject finish() {
+            if(bones > 0) {
+                result.insert("bones", bones);
+            }
+            if(animations > 0) {
+                result.insert("animations", animations);
+            }
+            result.insert("issues", issues);
+            return result;
+        }
+
+    private:
+        QJsonObject result;
+        QJsonArray issues;
+        QSet<QString> longNames;
+        int bones = 0;
+        int animations = 0;
+    };
+
+    QString boneName(const QString &name) {
+        return name == "root" ? name : "Dx_" + name;
+    }
+
+    // Reads only the vertex count of the shared geometry, which is all the
+    // converter takes from a mesh.
+    void scanXmlMesh(const QString &filename, Scan &scan) {
+        QFile file(filename);
+        if(!file.open(QIODevice::ReadOnly)) {
+            scan.fail("Couldn't open file.");
+            return;
+        }
+
+        QXmlStreamReader xml(&file);
+        if(xml.readNextStartElement() && xml.name() == QLatin1String("mesh")) {
+            while(xml.readNextStartElement()) {
+                if(xml.name() == QLatin1String("sharedgeometry")) {
+                    scan.vertices(xml.attributes().value("vertexcount").toInt());
+                    return;
+                }
+                xml.skipCurrentElement();
+            }
+        }
+        scan.fail(xml.hasError() ? xml.errorString() : "No shared geometry.");
+    }
+
+    void scanBinaryMesh(const QString &filename, Scan &scan) {
+        LxStream stream;
+        if(!OgreBinary::openFile(stream, filename)) {
+            scan.fail("Not an Ogre binary mesh.");
+            return;
+        }
+
+        OgreBinary::Chunk chunk;
+        while(OgreBinary::readChunk(stream, chunk)) {
+            if(chunk.id == OgreBinary::M_MESH) {
+                OgreBinary::readBool(stream); // Sub-chunks follow
+                continue;
+            }
+            if(chunk.id == OgreBinary::M_GEOMETRY) {
+                scan.vertices(stream.readInt());
+                return;
+            }
+            OgreBinary::skipChunk(stream, chunk);
+        }
+        scan.fail("No shared geometry.");
+    }
+
+    // Finds the start tag of the first or last <keyframe> in a cut section
+    // and reads its time.
+    bool keyframeTime(const QByteArray &section, bool last, float &time) {
+        static const QByteArray open = "<keyframe";
+        int from = last ? section.length() : 0;
+        while(true) {
+            int i = last ? section.lastIndexOf(open, from) : section.indexOf(open, from);
+            if(i < 0) {
+                return false;
+            }
+            char next = i + open.length() < section.length() ? section[i + open.length()] : '\0';
+            if(next == ' ' || next == '\t' || next == '\r' || next == '\n' || next == '>' || next == '/') {
+                int end = section.indexOf('>', i);
+                if(end < 0) {
+                    return false;
+                }
+                XmlScanner scanner(section.constData() + i, end - i + 1);
+                if(!scanner.readNextStartElement()) {
+                    return false;
+                }
+                time = scanner.attributes().value("time").toFloat();
+                return true;
+            }
+            from = last ? i - 1 : i + 1;
+            if(from < 0) {
+                return false;
+            }
+        }
+    }
+
+    // First and last keyframe time of a <keyframes> element. Large sections
+    // have been cut out by ParallelXml and only their ends are looked at.
+    bool keyframeRange(QXmlStreamReader &xml, const ParallelXml::Document *cuts, float &first, float &last) {
+        QXmlStreamAttributes attributes = xml.attributes();
+        if(cuts && attributes.hasAttribute(ParallelXml::CUT_ATTRIBUTE)) {
+            QByteArray section = cuts->section(attributes.value(ParallelXml::CUT_ATTRIBUTE).toInt());
+            xml.skipCurrentElement();
+            return keyframeTime(section, false, first) && keyframeTime(section, true, last);
+        }
+
+        bool found = false;
+        while(xml.readNextStartElement()) {
+            last = xml.attributes().value("time").toFloat();
+            if(!found) {
+                first = last;
+                found = true;
+            }
+            xml.skipCurrentElement();
+        }
+        return found;
+    }
+
+    void scanXmlAnimation(QXmlStreamReader &xml, const ParallelXml::Document *cuts, Scan &scan) {
+        QXmlStreamAttributes attributes = xml.attributes();
+        QString animation = attributes.value("name").toString();
+        float length = attributes.value("length").toFloat();
+        scan.animation();
+
+        bool gotTracks = false;
+        while(xml.readNextStartElement()) {
+            if(gotTracks || xml.name() != QLatin1String("tracks")) {
+                xml.skipCurrentElement();
+                continue;
+            }
+            gotTracks = true;
+
+            while(xml.readNextStartElement()) {
+                QString bone = boneName(xml.attributes().value("bone").toString());
+                bool gotKeyframes = false, found = false;
+                float first = 0, last = 0;
+                while(xml.readNextStartElement()) {
+                    if(gotKeyframes || xml.name() != QLatin1String("keyframes")) {
+                        xml.skipCurrentElement();
+                        continue;
+                    }
+                    gotKeyframes = true;
+                    found = keyframeRange(xml, cuts, first, last);
+                }
+                scan.track(animation, bone, length, found, first, last);
+            }
+        }
+    }
+
+    void scanXmlSkeleton(const QString &filename, Scan &scan) {
+        ParallelXml::Document cuts;
+        bool cut = ParallelXml::load(filename, {"keyframes"}, cuts);
+
+        QFile file(filename);
+        QXmlStreamReader xml;
+        if(cut) {
+            xml.addData(cuts.remainder);
+        } else if(file.open(QIODevice::ReadOnly)) {
+            xml.setDevice(&file);
+        } else {
+            scan.fail("Couldn't open file.");
+            return;
+        }
+
+        if(!xml.readNextStartElement() || xml.name() != QLatin1String("skeleton")) {
+            scan.fail(xml.hasError() ? xml.errorString() : "Not a skeleton.");
+            return;
+        }
+
+        bool gotBones = false, gotAnimations = false;
+        while(xml.readNextStartElement()) {
+            if(!gotBones && xml.name() == QLatin1String("bones")) {
+                gotBones = true;
+                while(xml.readNextStartElement()) {
+                    scan.bone(boneName(xml.attributes().value("name").toString()));
+                    xml.skipCurrentElement();
+                }
+            } else if(!gotAnimations && xml.name() == QLatin1String("animations")) {
+                gotAnimations = true;
+                while(xml.readNextStartElement()) {
+                    if(xml.name() == QLatin1String("animation")) {
+                        scanXmlAnimation(xml, cut ? &cuts : 0, scan);
+                    } else {
+                        xml.skipCurrentElement();
+                    }
+                }
+            } else {
+                xml.skipCurrentElement();
+            }
+        }
+
+        if(xml.hasError()) {
+            scan.fail(xml.errorString());
+        }
+    }
+
+    // Keyframe chunks are hopped over by their headers, only the time of the
+    // first and the last one is read.
+    void scanBinarySkeleton(const QString &filename, Scan &scan) {
+        LxStream stream;
+        if(!OgreBinary::openFile(stream, filename)) {
+            scan.fail("Not an Ogre binary skeleton.");
+            return;
+        }
+
+        QHash<int, QString> names;
+        QString animation;
+        float length = 0;
+
+        OgreBinary::Chunk chunk;
+        while(OgreBinary::readChunk(stream, chunk)) {
+            switch(chunk.id) {
+            case OgreBinary::SKELETON_BONE: {
+                QString name = boneName(OgreBinary::readString(stream));
+                names.insert((unsigned short)stream.readShort(), name);
+                scan.bone(name);
+                break;
+            }
+            case OgreBinary::SKELETON_ANIMATION:
+                animation = OgreBinary::readString(stream);
+                length = stream.readFloat();
+                scan.animation();
+                continue; // Tracks follow
+            case OgreBinary::SKELETON_ANIMATION_TRACK: {
+                QString bone = names.value((unsigned short)stream.readShort());
+                bool found = false;
+                float first = 0, last = 0;
+                long long lastStart = -1;
+
+                OgreBinary::Chunk keyframe;
+                while(stream.pos() < chunk.end && OgreBinary::readChunk(stream, keyframe)) {
+                    if(keyframe.id != OgreBinary::SKELETON_ANIMATION_TRACK_KEYFRAME) {
+                        OgreBinary::unreadChunk(stream);
+                        break;
+                    }
+                    if(!found) {
+                        first = stream.readFloat();
+                        found = true;
+                    }
+                    lastStart = stream.pos() - OgreBinary::CHUNK_HEADER_SIZE;
+                    OgreBinary::skipChunk(stream, keyframe);
+                }
+                if(found) {
+                    stream.seek(lastStart + OgreBinary::CHUNK_HEADER_SIZE);
+                    last = stream.readFloat();
+                }
+                scan.track(animation, bone, length, found, first, last);
+                break;
+            }
+            }
+            OgreBinary::skipChunk(stream, chunk);
+        }
+    }
+
+    // Everything needed is in the JSON chunk: accessor counts and the
+    // min/max that glTF requires on animation inputs.
+    void scanGltf(const QString &filename, Scan &scan) {
+        Gltf::File file;
+        if(!Gltf::openFile(file, filename)) {
+            scan.fail("Not a binary glTF file.");
+            return;
+        }
+
+        int mesh = -1;
+        int skin = Gltf::findSkin(file, &mesh);
+
+        if(mesh >= 0) {
+            int vertices = 0;
+            for(const QJsonValue &primitive : Gltf::object(file, "meshes", mesh).value("primitives").toArray()) {
+                int position = primitive.toObject().value("attributes").toObject().value("POSITION").toInt(-1);
+                vertices += Gltf::object(file, "accessors", position).value("count").toInt();
+            }
+            scan.vertices(vertices);
+        }
+
+        QHash<int, QString> names = Gltf::jointNames(file, skin);
+        for(const QString &name : names) {
+            scan.bone(boneName(name));
+        }
+
+        // The importer keys every track at the clip's end, so only a late
+        // first keyframe can be missing.
+        QJsonArray clips = file.json.value("animations").toArray();
+        for(int i = 0; i < clips.size(); i++) {
+            QJsonObject clip = clips.at(i).toObject();
+            QString animation = clip.value("name").toString();
+            if(animation.isEmpty()) {
+                animation = "animation" + QString::number(i);
+            }
+            scan.animation();
+
+            QJsonArray samplers = clip.value("samplers").toArray();
+            QHash<int, float> firsts;
+            float length = 0;
+            for(const QJsonValue &value : clip.value("channels").toArray()) {
+                QJsonObject channel = value.toObject();
+                int node = channel.value("target").toObject().value("node").toInt(-1);
+                QString path = channel.value("target").toObject().value("path").toString();
+                int sampler = channel.value("sampler").toInt(-1);
+                if(!names.contains(node) || (path != "translation" && path != "rotation")
+                        || sampler < 0 || sampler >= samplers.size()) {
+                    continue;
+                }
+
+                int input = samplers.at(sampler).toObject().value("input").toInt(-1);
+                QJsonObject accessor = Gltf::object(file, "accessors", input);
+                float first, last;
+                QJsonArray min = accessor.value("min").toArray(), max = accessor.value("max").toArray();
+                if(!min.isEmpty() && !max.isEmpty()) {
+                    first = min.at(0).toDouble();
+                    last = max.at(0).toDouble();
+                } else {
+                    QVector<float> times;
+                    int components = 0;
+                    if(!Gltf::readFloats(file, input, times, components) || times.isEmpty()) {
+                        continue;
+                    }
+                    first = times.first();
+                    last = times.last();
+                }
+
+                firsts.insert(node, firsts.contains(node) ? qMin(firsts.value(node), first) : first);
+                length = qMax(length, last);
+            }
+
+            for(auto it = firsts.constBegin(); it != firsts.constEnd(); ++it) {
+                scan.track(animation, boneName(names.value(it.key())), length, true, it.value(), length);
+            }
+        }
+    }
+
+    // The files below path that scanFile() understands, or path itself
+    QStringList assetFiles(const QString &path) {
+        if(!QFileInfo(path).isDir()) {
+            return {path};
+        }
+
+        QStringList files;
+        QDirIterator it(path, {"*.mesh.xml", "*.mesh", "*.skeleton.xml", "*.skeleton", "*.glb"},
+                        QDir::Files, QDirIterator::Subdirectories);
+        while(it.hasNext()) {
+            files.append(it.next());
+        }
+        files.sort();
+        return files;
+    }
+}
+
+QJsonObject Triage::scanFile(const QString &filename) {
+    Scan scan(filename);
+
+    if(filename.endsWith(".mesh.xml", Qt::CaseInsensitive)) {
+        scanXmlMesh(filename, scan);
+    } else if(filename.endsWith(".mesh", Qt::CaseInsensitive)) {
+        scanBinaryMesh(filename, scan);
+    } else if(filename.endsWith(".skeleton.xml", Qt::CaseInsensitive)) {
+        scanXmlSkeleton(filename, scan);
+    } else if(filename.endsWith(".skeleton", Qt::CaseInsensitive)) {
+        scanBinarySkeleton(filename, scan);
+    } else if(filename.endsWith(".glb", Qt::CaseInsensitive)) {
+        scanGltf(filename, scan);
+    } else {
+        scan.fail("Unknown file type.");
+    }
+
+    return scan.finish();
+}
+
+// Scans the given files and directories on all cores and writes one JSON
+// report. Returns false if any file has an issue or the report couldn't be
+// written.
+bool Triage::writeReport(const QStringList &paths, const QString &reportFile) {
+    QStringList files;
+    for(const QString &path : paths) {
+        files.append(assetFiles(path));
+    }
+
+    QList<QJsonObject> results = QtConcurrent::blockingMapped<QList<QJsonObject> >(files, scanFile);
+
+    QJsonArray entries;
+    int failing = 0;
+    for(const QJsonObject &result : results) {
+        if(!result.value("issues").toArray().isEmpty()) {
+            failing++;
+        }
+        entries.append(result);
+    }
+
+    QJsonObject report {
+        {"scanned", files.length()},
+        {"failing", failing},
+        {"files", entries}
+    };
+
+    QByteArray json = QJsonDocument(report).toJson();
+    LxStream stream;
+    stream.openAtomicFile(reportFile, json.size());
+    stream.writeByteArray(json);
+    if(!stream.close()) {
+        qDebug() << "Couldn't write" << reportFile;
+        return false;
+    }
+    return failing == 0;
+}
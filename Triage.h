@@ -0,0 +1,22 @@
+#ifndef TRIAGE_H
+#define TRIAGE_H
+
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+
+// A quick scan of assets for what the game's loaders reject or mangle,
+// without converting them. Only counts, names and the first and last
+// keyframe of each track are read.
+namespace Triage {
+    // The model loader refuses anything above this
+    const int MAX_VERTICES = 65536;
+
+    // Longer bone names are truncated by the model loader
+    const int MAX_BONE_NAME_LENGTH = 31;
+
+    QJsonObject scanFile(const QString &filename);
+    bool writeReport(const QStringList &paths, const QString &reportFile);
+}
+
+#endif // TRIAGE_H
@@ -2,9 +2,11 @@
 
 #include <QDomDocument>
 #include <QString>
+#include <QByteArray>
 #include <QFile>
 #include <QDebug>
 #include "LxStream.h"
+#include <limits>
 
 QDomDocument Utils::readXMLFile(QString filename) {
     QDomDocument doc("mydocument");
@@ -22,7 +24,25 @@ QDomDocument Utils::readXMLFile(QString filename) {
     return doc;
 }
 
-void Utils::writeString(LxStream &stream, QString str) {
+// Maps the opened file into memory, or reads it if it can't be mapped. The
+// bytes stay valid while the file is open.
+QByteArray Utils::mapFile(QFile &file) {
+    qint64 size = file.size();
+    if(size > 0 && size <= std::numeric_limits<int>::max()) {
+        uchar *data = file.map(0, size);
+        if(data) {
+            return QByteArray::fromRawData((const char *)data, size);
+        }
+    }
+    return file.readAll();
+}
+
+void Utils::writeString(LxStream &stream, const QString &str) {
     stream.writeInt(str.length());
     stream.writeQString(str);
 }
+
+// Number of bytes writeString() produces for str
+int Utils::stringSize(const QString &str) {
+    return 4 + str.length();
+}
@@ -3,11 +3,15 @@
 
 class QDomDocument;
 class QString;
+class QByteArray;
+class QFile;
 class LxStream;
 
 namespace Utils {
     QDomDocument readXMLFile(QString filename);
-    void writeString(LxStream &stream, QString str);
+    QByteArray mapFile(QFile &file);
+    void writeString(LxStream &stream, const QString &str);
+    int stringSize(const QString &str);
 }
 
 #endif // UTILS_H
@@ -0,0 +1,438 @@
+#include "XmlScanner.h"
+
+#include <QString>
+#include <QByteArray>
+#include <string.h>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define XML_SSE2
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+namespace {
+
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+inline bool isNameEnd(char c) {
+    return isSpace(c) || c == '>' || c == '/' || c == '=';
+}
+
+inline int firstBit(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Finds the first occurrence of any of the three bytes, 16 bytes at a time.
+const char *findAny(const char *p, const char *end, char a, char b, char c) {
+#ifdef XML_SSE2
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                     _mm_cmpeq_epi8(v, vc));
+        unsigned int mask = _mm_movemask_epi8(match);
+        if(mask != 0) {
+            return p + firstBit(mask);
+        }
+        p += 16;
+    }
+#endif
+    for(; p < end; p++) {
+        if(*p == a || *p == b || *p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a decimal number when the result is exactly representable by one
+// multiplication or division of doubles (Clinger's fast path), which is the
+// common case for exported vertex data. Then the result is correctly rounded
+// like QString::toDouble's. Returns false for everything else.
+bool parseDouble(const char *p, const char *end, double &result) {
+    while(p < end && isSpace(*p)) {
+        p++;
+    }
+    while(end > p && isSpace(end[-1])) {
+        end--;
+    }
+
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    // At least one digit before and after the decimal point, other forms are
+    // left to Qt
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    const char *start = p;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        if(mantissa == 0 && *p == '0') {
+            continue;
+        }
+        if(++digits > 19) {
+            return false;
+        }
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    if(p == start) {
+        return false;
+    }
+    if(p < end && *p == '.') {
+        p++;
+        start = p;
+        for(; p < end && *p >= '0' && *p <= '9'; p++) {
+            exponent--;
+            if(mantissa == 0 && *p == '0') {
+                continue;
+            }
+            if(++digits > 19) {
+                return false;
+            }
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        if(p == start) {
+            return false;
+        }
+    }
+
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negativeExponent = false;
+        if(p < end && (*p == '-' || *p == '+')) {
+            negativeExponent = *p == '-';
+            p++;
+        }
+        if(p == end || *p < '0' || *p > '9') {
+            return false;
+        }
+        int e = 0;
+        for(; p < end && *p >= '0' && *p <= '9'; p++) {
+            if(e > 1000) {
+                return false;
+            }
+            e = e * 10 + (*p - '0');
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+    if(p != end) {
+        return false;
+    }
+
+    double d = double(mantissa);
+    if(mantissa == 0) {
+        exponent = 0;
+    }
+    if(mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) {
+        return false;
+    }
+
+    d = exponent < 0 ? d / POWERS_OF_TEN[-exponent] : d * POWERS_OF_TEN[exponent];
+    result = negative ? -d : d;
+    return true;
+}
+
+bool parseInt(const char *p, const char *end, int &result) {
+    while(p < end && isSpace(*p)) {
+        p++;
+    }
+    while(end > p && isSpace(end[-1])) {
+        end--;
+    }
+
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if(p == end || end - p > 9) {
+        return false;
+    }
+
+    int value = 0;
+    for(; p < end; p++) {
+        if(*p < '0' || *p > '9') {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    result = negative ? -value : value;
+    return true;
+}
+
+}
+
+float XmlScanner::Value::toFloat() const {
+    // Values that overflow or underflow a float are handled differently
+    // between Qt versions, so those take Qt's path.
+    double d;
+    if(parseDouble(begin, end, d) && std::fabs(d) <= std::numeric_limits<float>::max()
+            && (d == 0 || float(d) != 0)) {
+        return float(d);
+    }
+    return QString::fromUtf8(begin, end - begin).toFloat();
+}
+
+double XmlScanner::Value::toDouble() const {
+    double d;
+    if(parseDouble(begin, end, d)) {
+        return d;
+    }
+    return QString::fromUtf8(begin, end - begin).toDouble();
+}
+
+int XmlScanner::Value::toInt() const {
+    int i;
+    if(parseInt(begin, end, i)) {
+        return i;
+    }
+    return QString::fromUtf8(begin, end - begin).toInt();
+}
+
+bool XmlScanner::Value::operator==(QLatin1String s) const {
+    return end - begin == s.size() && (s.size() == 0 || memcmp(begin, s.data(), s.size()) == 0);
+}
+
+// Ogre writes attributes in a fixed order, so the attribute after the last
+// match is tried first. A missing attribute reads as an empty value.
+XmlScanner::Value XmlScanner::Attributes::value(const char *name) {
+    int length = strlen(name);
+    for(int i = 0; i < count; i++) {
+        int index = (next + i) % count;
+        const Attribute &a = attributes[index];
+        if(a.nameLength == length && memcmp(a.name, name, length) == 0) {
+            next = index + 1;
+            return Value(a.value, a.value + a.valueLength);
+        }
+    }
+    return Value(0, 0);
+}
+
+bool XmlScanner::Attributes::hasAttribute(const char *name) const {
+    int length = strlen(name);
+    for(int i = 0; i < count; i++) {
+        if(attributes[i].nameLength == length && memcmp(attributes[i].name, name, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+XmlScanner::XmlScanner(const char *data, int length)
+{
+    pos = data;
+    end = data + length;
+    error = false;
+    pendingEnd = false;
+    elementName = 0;
+    elementNameLength = 0;
+    attributeCount = 0;
+    depth = 0;
+
+    // A UTF-8 byte order mark
+    if(length >= 3 && memcmp(pos, "\xEF\xBB\xBF", 3) == 0) {
+        pos += 3;
+    }
+}
+
+bool XmlScanner::fail() {
+    error = true;
+    return false;
+}
+
+// Like QXmlStreamReader: returns true at the next child element of the
+// current element and false once the current element ends. The end of the
+// data counts as the end of the outermost element.
+bool XmlScanner::readNextStartElement() {
+    if(error) {
+        return false;
+    }
+    if(pendingEnd) {
+        pendingEnd = false;
+        depth--;
+        return false;
+    }
+
+    do {
+        while(pos < end && isSpace(*pos)) {
+            pos++;
+        }
+        if(pos == end) {
+            return depth == 0 ? false : fail();
+        }
+    } while(skipMarkup());
+    if(error) {
+        return false;
+    }
+    if(*pos != '<' || end - pos < 2 || pos[1] == '!' || pos[1] == '?') {
+        return fail();
+    }
+    if(pos[1] == '/') {
+        readEndTag();
+        return false;
+    }
+    return readStartTag();
+}
+
+// Skips a comment or a processing instruction such as the XML declaration.
+// A declared encoding other than UTF-8 is an error. Returns false if there
+// is nothing to skip.
+bool XmlScanner::skipMarkup() {
+    const char *close;
+    if(end - pos >= 4 && memcmp(pos, "<!--", 4) == 0) {
+        close = "-->";
+    } else if(end - pos >= 2 && memcmp(pos, "<?", 2) == 0) {
+        close = "?>";
+    } else {
+        return false;
+    }
+
+    const char *start = pos;
+    int closeLength = strlen(close);
+    const char *markupEnd = std::search(pos + 2, end, close, close + closeLength);
+    if(markupEnd == end) {
+        return fail();
+    }
+    pos = markupEnd + closeLength;
+
+    if(end - start >= 6 && memcmp(start, "<?xml", 5) == 0 && isSpace(start[5])) {
+        QByteArray declaration = QByteArray::fromRawData(start, markupEnd - start);
+        int encoding = declaration.indexOf("encoding");
+        if(encoding >= 0) {
+            QByteArray value = declaration.mid(encoding + 8).replace('=', ' ').replace('"', ' ')
+                    .replace('\'', ' ').simplified();
+            if(!value.toLower().startsWith("utf-8")) {
+                return fail();
+            }
+        }
+    }
+    return true;
+}
+
+void XmlScanner::skipCurrentElement() {
+    int target = depth - 1;
+    while(!error && depth > target) {
+        readNextStartElement();
+    }
+}
+
+bool XmlScanner::readStartTag() {
+    pos++;
+    const char *name = pos;
+    while(pos < end && !isNameEnd(*pos)) {
+        pos++;
+    }
+    if(pos == name || depth == MaxDepth) {
+        return fail();
+    }
+    elementName = name;
+    elementNameLength = pos - name;
+    attributeCount = 0;
+
+    while(true) {
+        while(pos < end && isSpace(*pos)) {
+            pos++;
+        }
+        if(pos == end) {
+            return fail();
+        }
+        if(*pos == '>') {
+            pos++;
+            break;
+        }
+        if(*pos == '/') {
+            if(end - pos < 2 || pos[1] != '>') {
+                return fail();
+            }
+            pos += 2;
+            pendingEnd = true;
+            break;
+        }
+
+        if(attributeCount == MaxAttributes) {
+            return fail();
+        }
+        Attribute &a = attributeList[attributeCount++];
+        a.name = pos;
+        while(pos < end && !isNameEnd(*pos)) {
+            pos++;
+        }
+        a.nameLength = pos - a.name;
+        while(pos < end && isSpace(*pos)) {
+            pos++;
+        }
+        if(a.nameLength == 0 || pos == end || *pos != '=') {
+            return fail();
+        }
+        pos++;
+        while(pos < end && isSpace(*pos)) {
+            pos++;
+        }
+        if(pos == end || (*pos != '"' && *pos != '\'')) {
+            return fail();
+        }
+
+        // Entities and stray '<' are left to QXmlStreamReader
+        char quote = *pos++;
+        const char *valueEnd = findAny(pos, end, quote, '&', '<');
+        if(valueEnd == end || *valueEnd != quote) {
+            return fail();
+        }
+        a.value = pos;
+        a.valueLength = valueEnd - pos;
+        pos = valueEnd + 1;
+        if(pos < end && !isSpace(*pos) && *pos != '>' && *pos != '/') {
+            return fail();
+        }
+    }
+
+    openNames[depth] = elementName;
+    openNameLengths[depth] = elementNameLength;
+    depth++;
+    return true;
+}
+
+bool XmlScanner::readEndTag() {
+    if(depth == 0) {
+        return fail();
+    }
+    pos += 2;
+    const char *name = pos;
+    while(pos < end && !isNameEnd(*pos)) {
+        pos++;
+    }
+    int length = pos - name;
+    while(pos < end && isSpace(*pos)) {
+        pos++;
+    }
+    if(pos == end || *pos != '>' || length != openNameLengths[depth - 1]
+            || memcmp(name, openNames[depth - 1], length) != 0) {
+        return fail();
+    }
+    pos++;
+    depth--;
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef XMLSCANNER_H
+#define XMLSCANNER_H
+
+#include <QLatin1String>
+#include <QString>
+
+// Minimal pull parser for the plain element lists in Ogre XML files. It works
+// on the raw UTF-8 bytes and converts attribute values straight from them,
+// without creating any strings.
+//
+// It offers the subset of QXmlStreamReader's interface that the element
+// readers use, so they can be written once for both. Comments and the XML
+// declaration are skipped. Everything else it doesn't handle (entities, text
+// content, CDATA, other encodings, ...) is reported as an error, in which
+// case the caller parses the same bytes with QXmlStreamReader instead.
+class XmlScanner
+{
+public:
+    struct Attribute {
+        const char *name;
+        int nameLength;
+        const char *value;
+        int valueLength;
+    };
+
+    // An attribute value, converted like QStringRef would convert it
+    class Value {
+    public:
+        Value(const char *begin, const char *end) : begin(begin), end(end) {}
+        float toFloat() const;
+        double toDouble() const;
+        int toInt() const;
+        QString toString() const { return QString::fromUtf8(begin, end - begin); }
+        bool operator==(QLatin1String s) const;
+        bool operator!=(QLatin1String s) const { return !(*this == s); }
+    private:
+        const char *begin;
+        const char *end;
+    };
+
+    class Attributes {
+    public:
+        Attributes(const Attribute *attributes, int count) : attributes(attributes), count(count), next(0) {}
+        Value value(const char *name);
+        bool hasAttribute(const char *name) const;
+    private:
+        const Attribute *attributes;
+        int count;
+        int next;
+    };
+
+    XmlScanner(const char *data, int length);
+
+    bool readNextStartElement();
+    void skipCurrentElement();
+    QLatin1String name() const { return QLatin1String(elementName, elementNameLength); }
+    Attributes attributes() const { return Attributes(attributeList, attributeCount); }
+    bool hasError() const { return error; }
+
+private:
+    enum {
+        MaxDepth = 64,
+        MaxAttributes = 16
+    };
+
+    bool skipMarkup();
+    bool readStartTag();
+    bool readEndTag();
+    bool fail();
+
+    const char *pos;
+    const char *end;
+    bool error;
+    bool pendingEnd;
+
+    const char *elementName;
+    int elementNameLength;
+    Attribute attributeList[MaxAttributes];
+    int attributeCount;
+
+    int depth;
+    const char *openNames[MaxDepth];
+    int openNameLengths[MaxDepth];
+};
+
+#endif // XMLSCANNER_H
@@ -3,6 +3,9 @@
 #include "QDebug"
 #include "Animation.h"
 #include "Skeleton.h"
+#include "LxBatchWriter.h"
+#include "Triage.h"
+#include "AssetCache.h"
 #include <QtMath>
 
 void exportTestStuff() {
@@ -19,22 +22,44 @@ void exportTestStuff() {
     anim.exportAnm("dragon_idle.anm");
 }
 
-void exportAnim(Skeleton bindPose, QString name, ExtraData extraData = ExtraData()) {
-    Animation anim = Animation::fromFile("animations/" + name.toUpper() + ".SKELETON.xml");
-    anim.applyBindPose(bindPose);
-    anim.setExtraData(extraData);
-    anim.exportAnm("dragon/anm/dragon_" + name.toLower() + ".anm");
+// Each clip is split into its own file, so its animation is the first one
+// in there whatever it is called.
+void exportAnim(LxBatchWriter &batch, const Skeleton &bindPose, QString name, ExtraData extraData = ExtraData()) {
+    QList<Animation> anims = Animation::allFromFile("animations/" + name.toUpper() + ".SKELETON.xml", true);
+    if(anims.isEmpty()) {
+        qDebug() << "No animation to export for" << name;
+        return;
+    }
+    Animation::exportAll(anims, bindPose, { {anims.first().name(), "dragon/anm/dragon_" + name.toLower() + ".anm", extraData} }, &batch);
 }
 
-void exportRealStuff() {
-    Model m = Model::fromFile("TOWER_DRAGON.MESH.xml");
+// Welding, cleanup and the influence limit are off unless asked for, so the
+// default export is unchanged.
+void exportRealStuff(float weldTolerance = 0, bool cleanupMesh = false, int maxInfluences = 0) {
+    // All output files are kept in memory and written together at the end.
+    LxBatchWriter batch;
+
+    Model m = Model::fromFile("TOWER_DRAGON.MESH.xml", true);
+    if(weldTolerance > 0) {
+        // Merges the float noise duplicates left by the Ogre exporter
+        qDebug() << "Welded" << m.weld(weldTolerance) << "vertices";
+    }
+    if(cleanupMesh) {
+        CleanupReport cleanup = m.cleanup();
+        qDebug() << "Removed" << cleanup.invalidFaces << "invalid," << cleanup.degenerateFaces << "degenerate,"
+                 << cleanup.zeroAreaFaces << "zero-area and" << cleanup.duplicateFaces << "duplicate faces and"
+                 << cleanup.unusedVertices << "unused vertices";
+    }
+    if(maxInfluences > 0) {
+        m.limitInfluences(maxInfluences);
+    }
     Skeleton bindPose = Skeleton::fromFile("TOWER_DRAGON.SKELETON.xml");
     m.addSkeleton(bindPose);
 
-    m.exportMDL("dragon.mdl");
+    m.exportMDL("dragon.mdl", &batch);
 
     Model mDummy = Model::dummy();
-    mDummy.exportMDL("dummy.mdl");
+    mDummy.exportMDL("dummy.mdl", &batch);
 
     /* BOSSDRAGONATTACK         -> SwipeRight
      * BOSSDRAGONSNORT          -> genericSound2
@@ -59,12 +84,12 @@ void exportRealStuff() {
      * FOOTSTEP -> L Footstep
      */
 
-    exportAnim(bindPose, "idle", { {
+    exportAnim(batch, bindPose, "idle", { {
                                        {"genericSound2", 4},
                                        {"genericSound2", 9},
                                    } });
 
-    exportAnim(bindPose, "attack1", { {
+    exportAnim(batch, bindPose, "attack1", { {
                                           {"RightHandHit", 15},
                                           {"SwipeRight", 7},
                                           {"genericSound2", 33},
@@ -74,7 +99,7 @@ void exportRealStuff() {
                                       }, {
                                           {"Records\\creatures\\dragon\\skills\\clawswipe_helper_spawn.dbr", "ClawAttack", 16},
                                       } });
-    exportAnim(bindPose, "attack2", { {
+    exportAnim(batch, bindPose, "attack2", { {
                                           {"RightHandHit", 14},
                                           {"SwipeRight", 6},
                                           {"genericSound2", 32},
@@ -83,34 +108,38 @@ void exportRealStuff() {
                                       }, {
                                           {"Records\\creatures\\dragon\\skills\\clawswipe_helper_spawn.dbr", "ClawAttack", 16},
                                       } });
-//    exportAnim(bindPose, "attack3");
-//    exportAnim(bindPose, "die1");
-//    exportAnim(bindPose, "dragon_flyby");
-//    exportAnim(bindPose, "land_spawn");
+//    exportAnim(batch, bindPose, "attack3");
+//    exportAnim(batch, bindPose, "die1");
+//    exportAnim(batch, bindPose, "dragon_flyby");
+//    exportAnim(batch, bindPose, "land_spawn");
 
-    exportAnim(bindPose, "run", { {
+    exportAnim(batch, bindPose, "run", { {
                                       {"L Footstep", 20},
                                       {"R Footstep", 4},
                                       {"genericSound2", 2},
                                       {"genericSound2", 15},
                                   } });
 
-//    exportAnim(bindPose, "soar");
-//    exportAnim(bindPose, "special_breath");
-//    exportAnim(bindPose, "special_fireball");
-//    exportAnim(bindPose, "special_fly_slam");
-    //    exportAnim(bindPose, "special_flyby");
-    //    exportAnim(bindPose, "special_hover_fire");
-    exportAnim(bindPose, "special_tailwhip", { {
+//    exportAnim(batch, bindPose, "soar");
+//    exportAnim(batch, bindPose, "special_breath");
+//    exportAnim(batch, bindPose, "special_fireball");
+//    exportAnim(batch, bindPose, "special_fly_slam");
+    //    exportAnim(batch, bindPose, "special_flyby");
+    //    exportAnim(batch, bindPose, "special_hover_fire");
+    exportAnim(batch, bindPose, "special_tailwhip", { {
                                                    {"RightHandHit", 6},
                                                    {"specialAttackSound2", 14},
                                                    {"specialAttackSound3", 23},
                                                } });
-//    exportAnim(bindPose, "special_takeoff");
-//    exportAnim(bindPose, "special_wingbuff_end");
-//    exportAnim(bindPose, "special_wingbuff_loop");
-//    exportAnim(bindPose, "special_wingbuff_start");
-//    exportAnim(bindPose, "walk");
+//    exportAnim(batch, bindPose, "special_takeoff");
+//    exportAnim(batch, bindPose, "special_wingbuff_end");
+//    exportAnim(batch, bindPose, "special_wingbuff_loop");
+//    exportAnim(batch, bindPose, "special_wingbuff_start");
+//    exportAnim(batch, bindPose, "walk");
+
+    if(!batch.flush()) {
+        qDebug() << "Couldn't write all files.";
+    }
 }
 
 void exportDummy() {
@@ -179,9 +208,50 @@ void test() {
     qDebug() << "HAVE:" << resultAll * point;
 }
 
-int main(int , char *[])
+int main(int argc, char *argv[])
 {
-    exportRealStuff();
+    // Ogre2GrimDawn [--cache <directory>] ...
+    // Parsed assets are only cached when a directory is given.
+    int arg = 1;
+    if(argc >= arg + 2 && QString(argv[arg]) == "--cache") {
+        AssetCache::setDirectory(QString::fromLocal8Bit(argv[arg + 1]));
+        arg += 2;
+    }
+
+    // Ogre2GrimDawn [--weld <tolerance>] welds vertices closer than the
+    // tolerance before exporting, e.g. --weld 0.0001.
+    float weldTolerance = 0;
+    if(argc >= arg + 2 && QString(argv[arg]) == "--weld") {
+        weldTolerance = QString(argv[arg + 1]).toFloat();
+        arg += 2;
+    }
+
+    // Ogre2GrimDawn [--cleanup] drops broken, duplicate and zero-area faces
+    // and the vertices no face uses before exporting.
+    bool cleanupMesh = false;
+    if(argc >= arg + 1 && QString(argv[arg]) == "--cleanup") {
+        cleanupMesh = true;
+        arg++;
+    }
+
+    // Ogre2GrimDawn [--max-influences <n>] keeps the n heaviest bones of every
+    // vertex and scales their weights to add up to 1, e.g. --max-influences 4.
+    int maxInfluences = 0;
+    if(argc >= arg + 2 && QString(argv[arg]) == "--max-influences") {
+        maxInfluences = QString(argv[arg + 1]).toInt();
+        arg += 2;
+    }
+
+    // Ogre2GrimDawn --triage <report.json> <files or directories>...
+    if(argc >= arg + 3 && QString(argv[arg]) == "--triage") {
+        QStringList paths;
+        for(int i = arg + 2; i < argc; i++) {
+            paths.append(QString::fromLocal8Bit(argv[i]));
+        }
+        return Triage::writeReport(paths, QString::fromLocal8Bit(argv[arg + 1])) ? 0 : 1;
+    }
+
+    exportRealStuff(weldTolerance, cleanupMesh, maxInfluences);
 //    exportTestStuff();
 //    test();
 //    exportDummy();
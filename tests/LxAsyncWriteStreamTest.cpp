@@ -0,0 +1,92 @@
+// Checks that LxAsyncWriteStream keeps the seek-back-and-patch pattern of
+// the exporters working and that write errors from the writer thread come
+// back from close().
+
+#include "LxStream.h"
+#include <stdlib.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    if(!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    }
+
+// Writes a size placeholder, a body that spans many blocks and a trailer,
+// then seeks back to fill in the size like a section writer would.
+static void testSeekBackPatch(const std::string &dir)
+{
+    const std::string filename = dir + "/patched.bin";
+    const int count = 1000;
+
+    LxStream stream;
+    stream.openFile(filename.c_str(), LxStream::WriteOnly);
+    stream.setAsync(64);
+    long long sizePos = stream.pos();
+    stream.writeInt(0);
+    for(int i = 0; i < count; i++)
+        stream.writeInt(i);
+    long long endPos = stream.pos();
+    CHECK(endPos == 4 + count * 4);
+
+    stream.seek(sizePos);
+    stream.writeInt(int(endPos - sizePos - 4));
+    stream.seek(endPos);
+    stream.writeInt(-1);
+    CHECK(stream.pos() == endPos + 4);
+    CHECK(stream.close());
+
+    LxStream in;
+    in.openFile(filename.c_str(), LxStream::ReadOnly);
+    CHECK(in.size() == endPos + 4);
+    CHECK(in.readInt() == count * 4);
+    bool body = true;
+    for(int i = 0; i < count; i++)
+        body = body && in.readInt() == i;
+    CHECK(body);
+    CHECK(in.readInt() == -1);
+    in.close();
+}
+
+// /dev/full fails every write with ENOSPC. A small file only reaches the
+// device when it is flushed on close, a large one already fails on the
+// writer thread; both have to be reported by close().
+static void testErrorReportedOnClose()
+{
+    const std::string small(10, 'a');
+    const std::string large(1 << 20, 'b');
+
+    LxStream smallStream;
+    smallStream.openFile("/dev/full", LxStream::WriteOnly);
+    smallStream.setAsync(64);
+    smallStream.writeData(small.data(), small.size());
+    CHECK(!smallStream.close());
+
+    LxStream largeStream;
+    largeStream.openFile("/dev/full", LxStream::WriteOnly);
+    largeStream.setAsync(4096);
+    largeStream.writeData(large.data(), large.size());
+    CHECK(!largeStream.close());
+}
+
+int main()
+{
+    char dirTemplate[] = "/tmp/LxAsyncWriteStreamTest.XXXXXX";
+    if(mkdtemp(dirTemplate) == NULL) {
+        printf("Couldn't create a temporary directory\n");
+        return 1;
+    }
+    std::string dir = dirTemplate;
+
+    testSeekBackPatch(dir);
+    testErrorReportedOnClose();
+
+    std::string cleanup = "rm -rf " + dir;
+    if(system(cleanup.c_str()) != 0)
+        printf("Couldn't remove %s\n", dir.c_str());
+
+    if(failures == 0)
+        printf("All checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+# Plain C++ test of LxAsyncWriteStream, run the built binary from any directory.
+
+TEMPLATE = app
+TARGET = LxAsyncWriteStreamTest
+CONFIG += console c++11
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ..
+unix:LIBS += -lpthread
+
+SOURCES += LxAsyncWriteStreamTest.cpp
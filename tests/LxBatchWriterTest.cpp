@@ -0,0 +1,123 @@
+// Checks that a batch in which one file fails to write leaves that file's
+// target as it was and still writes the others. The failure is made real
+// with RLIMIT_FSIZE, so the write is cut off partway through the file.
+
+#include "LxBatchWriter.h"
+#include <sys/resource.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    if(!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    }
+
+static std::string readFile(const std::string &filename)
+{
+    std::string contents;
+    FILE *file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+        return "<missing>";
+    char buffer[4096];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, n);
+    fclose(file);
+    return contents;
+}
+
+static void writeFile(const std::string &filename, const std::string &contents)
+{
+    FILE *file = fopen(filename.c_str(), "wb");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+}
+
+static int countTemporaryFiles(const std::string &dir)
+{
+    int count = 0;
+    DIR *d = opendir(dir.c_str());
+    while(dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+static void addFile(LxBatchWriter &batch, const std::string &filename, const std::string &contents)
+{
+    LxStream stream;
+    batch.open(stream, filename.c_str());
+    stream.writeData(contents.data(), contents.size());
+    stream.close();
+}
+
+static void testFailedWriteKeepsTarget(const std::string &dir)
+{
+    const std::string small(1000, 'a');
+    const std::string large(1 << 20, 'b');
+    writeFile(dir + "/large.mdl", "old contents");
+
+    // Writes past 64 KB fail with EFBIG instead of raising SIGXFSZ
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit previous;
+    getrlimit(RLIMIT_FSIZE, &previous);
+    rlimit limit = previous;
+    limit.rlim_cur = 64 * 1024;
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    LxBatchWriter batch;
+    addFile(batch, dir + "/first.mdl", small);
+    addFile(batch, dir + "/large.mdl", large);
+    addFile(batch, dir + "/last.mdl", small);
+    bool ok = batch.flush();
+
+    setrlimit(RLIMIT_FSIZE, &previous);
+
+    CHECK(!ok);
+    CHECK(readFile(dir + "/first.mdl") == small);
+    CHECK(readFile(dir + "/large.mdl") == "old contents");
+    CHECK(readFile(dir + "/last.mdl") == small);
+    CHECK(countTemporaryFiles(dir) == 0);
+}
+
+static void testUnwritableTarget(const std::string &dir)
+{
+    LxBatchWriter batch;
+    addFile(batch, dir + "/before.anm", "before");
+    addFile(batch, dir + "/missing/inside.anm", "inside");
+    addFile(batch, dir + "/after.anm", "after");
+
+    CHECK(!batch.flush());
+    CHECK(readFile(dir + "/before.anm") == "before");
+    CHECK(readFile(dir + "/missing/inside.anm") == "<missing>");
+    CHECK(readFile(dir + "/after.anm") == "after");
+    CHECK(countTemporaryFiles(dir) == 0);
+}
+
+int main()
+{
+    char dirTemplate[] = "/tmp/LxBatchWriterTest.XXXXXX";
+    if(mkdtemp(dirTemplate) == NULL) {
+        printf("Couldn't create a temporary directory\n");
+        return 1;
+    }
+    std::string dir = dirTemplate;
+
+    testFailedWriteKeepsTarget(dir);
+    testUnwritableTarget(dir);
+
+    std::string cleanup = "rm -rf " + dir;
+    if(system(cleanup.c_str()) != 0)
+        printf("Couldn't remove %s\n", dir.c_str());
+
+    if(failures == 0)
+        printf("All checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
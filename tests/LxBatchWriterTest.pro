@@ -0,0 +1,11 @@
+# Plain C++ test of LxBatchWriter, run the built binary from any directory.
+
+TEMPLATE = app
+TARGET = LxBatchWriterTest
+CONFIG += console c++11
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ..
+unix:LIBS += -lpthread
+
+SOURCES += LxBatchWriterTest.cpp